@@ -16,6 +16,12 @@
   You should have received a copy of the GNU General Public License
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+/* POSIX.1-2008 for ftello, fseeko and st_mtim; 64-bit file offsets */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#if defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -25,6 +31,18 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <float.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
 
 char *version = "Tue May 31 13:33:54 EDT 2016";
 
@@ -188,29 +206,87 @@ getLine (FILE *fp)
     }
 }
 
-static int
-split (char *s, char **a, int m)
+/* openInput:
+        Open a file for reading, transparently decompressing it if it starts
+        with a gzip or zstd magic number.  Compressed files are decoded by
+        a child "gzip -dc" or "zstd -dc" writing into a pipe, so decoding
+        runs alongside parsing and never touches the disk.  *decoder is set
+        to the child's pid, or to zero for plain files.  Returns NULL if the
+        file can't be opened.
+*/
+static FILE *
+openInput (char *name, pid_t *decoder)
 {
-  int n = 0;
-
-  while (n < m)
+  static char *gzip[] = { "gzip", "-dc", (char *) 0 };
+  static char *zstd[] = { "zstd", "-dcq", (char *) 0 };
+  unsigned char magic[4];
+  char **command = (char **) 0;
+  int fd, pipefd[2];
+  ssize_t got;
+  pid_t pid;
+
+  *decoder = 0;
+
+  if ((fd = open (name, O_RDONLY)) < 0)
+    return (FILE *) 0;
+
+  got = read (fd, magic, sizeof (magic));
+  if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    command = gzip;
+  else if (
+    got == 4
+    && magic[0] == 0x28 && magic[1] == 0xb5
+    && magic[2] == 0x2f && magic[3] == 0xfd
+  )
+    command = zstd;
+
+  if (lseek (fd, 0, SEEK_SET) != 0)
+    error ("cannot rewind \"%s\"\n", name);
+
+  if (command == (char **) 0)
+    return fdopen (fd, "r");
+
+  if (pipe (pipefd) < 0 || (pid = fork ()) < 0)
+    error ("cannot start %s for \"%s\"\n", command[0], name);
+
+  if (pid == 0)
     {
-      for (; isspace (*s); s++)
-        ;
-      if (*s == '\0')
-        return n;
+      dup2 (fd, 0);
+      dup2 (pipefd[1], 1);
+      close (fd);
+      close (pipefd[0]);
+      close (pipefd[1]);
+      execvp (command[0], command);
+      _exit (127);
+    }
 
-      a[n++] = s;
+  close (fd);
+  close (pipefd[1]);
+  *decoder = pid;
+  return fdopen (pipefd[0], "r");
+}
 
-      for (s++; *s && !isspace (*s); s++)
-        ;
-      if (*s == '\0')
-        return n;
+/* closeInput:
+        Close a file opened by openInput.  A decoder that didn't exit
+        cleanly (truncated input, missing gzip or zstd) is an error, since
+        we might otherwise have silently parsed part of the file.
+*/
+static void
+closeInput (FILE *fp, pid_t decoder, char *name)
+{
+  int status;
 
-      *s++ = '\0';
-    }
+  fclose (fp);
 
-  return n;
+  if (decoder == 0)
+    return;
+
+  while (waitpid (decoder, &status, 0) < 0)
+    if (errno != EINTR)
+      error ("cannot wait for decompression of \"%s\"\n", name);
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    error ("cannot decompress \"%s\"\n", name);
 }
 
 /* Code specific to this program starts here. */
@@ -239,6 +315,163 @@ naturalNumber (char *s)
   return value;
 }
 
+/* TREC_BLANK:
+        The characters isspace() accepts in the C locale.
+*/
+#define TREC_BLANK(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+/* trecFieldEnd:
+        Return a pointer to the first blank or '\0' at or after s.
+        With SSE2, sixteen bytes are checked at a time for anything <= ' ';
+        only those candidates are examined one by one.  Loads are aligned,
+        so they never cross into a page past the terminating '\0'.
+*/
+static char *
+trecFieldEnd (char *s)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+  const __m128i space = _mm_set1_epi8 (' ');
+  unsigned misalign = (unsigned) ((uintptr_t) s & 15);
+  char *p = s - misalign;
+  unsigned mask = 0xffffu << misalign;
+
+  for (;;)
+    {
+      __m128i x = _mm_load_si128 ((const __m128i *) p);
+
+      mask &= (unsigned) _mm_movemask_epi8 (
+        _mm_cmpeq_epi8 (_mm_min_epu8 (x, space), x)
+      );
+      while (mask)
+        {
+          unsigned char c = (unsigned char) p[__builtin_ctz (mask)];
+
+          if (c == '\0' || TREC_BLANK (c))
+            return p + __builtin_ctz (mask);
+          mask &= mask - 1;
+        }
+      p += 16;
+      mask = 0xffffu;
+    }
+#else
+  for (; *s && !TREC_BLANK (*s); s++)
+    ;
+  return s;
+#endif
+}
+
+/* trecSplit:
+        Split a line into at most m blank-separated fields, in place.
+        Same behavior as a split() on isspace(), but with the field scan
+        done by trecFieldEnd.  Returns the number of fields found.
+*/
+static int
+trecSplit (char *s, char **a, int m)
+{
+  int n = 0;
+
+  while (n < m)
+    {
+      for (; TREC_BLANK (*s); s++)
+        ;
+      if (*s == '\0')
+        return n;
+
+      a[n++] = s;
+
+      s = trecFieldEnd (s + 1);
+      if (*s == '\0')
+        return n;
+
+      *s++ = '\0';
+    }
+
+  return n;
+}
+
+/* trecScoreFast:
+        Clinger's fast path for decimal scores.  When the significand fits
+        in 53 bits and the decimal exponent is within the exactly
+        representable powers of ten, one multiply or divide gives the
+        correctly rounded double.  Returns 0 if s doesn't qualify.
+*/
+static int
+trecScoreFast (char *s, double *score)
+{
+#if FLT_EVAL_METHOD == 0
+  static const double power[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  uint64_t m = 0;
+  int digits = 0, significant = 0, e = 0, negative = 0;
+  double value;
+
+  if (*s == '-' || *s == '+')
+    negative = (*s++ == '-');
+
+  for (; *s >= '0' && *s <= '9'; s++, digits++)
+    if (m || *s != '0')
+      {
+        if (++significant > 19)
+          return 0;
+        m = 10*m + (*s - '0');
+      }
+
+  if (*s == '.')
+    for (s++; *s >= '0' && *s <= '9'; s++, digits++, e--)
+      if (m || *s != '0')
+        {
+          if (++significant > 19)
+            return 0;
+          m = 10*m + (*s - '0');
+        }
+
+  if (digits == 0)
+    return 0;
+
+  if (*s == 'e' || *s == 'E')
+    {
+      int x = 0, xNegative = 0;
+
+      s++;
+      if (*s == '-' || *s == '+')
+        xNegative = (*s++ == '-');
+      if (*s < '0' || *s > '9')
+        return 0;
+      for (; *s >= '0' && *s <= '9'; s++)
+        if ((x = 10*x + (*s - '0')) > 1000)
+          return 0;
+      e += (xNegative ? -x : x);
+    }
+
+  if (*s != '\0' || m > ((uint64_t) 1 << 53) || e < -22 || e > 22)
+    return 0;
+
+  value = (double) m;
+  value = (e < 0 ? value/power[-e] : value*power[e]);
+  *score = (negative ? -value : value);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* trecScore:
+        Parse the score column of a run.  Anything the fast path declines
+        (long significands, huge exponents, hex, inf, trailing junk) goes
+        to strtod, which accepts the same prefixes sscanf("%lf") did.
+*/
+static double
+trecScore (char *s)
+{
+  double score;
+
+  if (trecScoreFast (s, &score))
+    return score;
+  return strtod (s, (char **) 0);
+}
+
 /* struct result:
         Information for given docno for a given topic for a given runid.
         rank  = rank in this run
@@ -275,31 +508,6 @@ dumpResults (struct result *r, int size)
     );
 }
 
-/* resultCompareByRank:
-     qsort comparison funtion for results; sort by topic and then by rank
-*/
-static int
-resultCompareByRank (const void *a, const void *b)
-{
-  struct result *ar = (struct result *) a;
-  struct result *br = (struct result *) b;
-  if (ar->topic < br->topic)
-    return -1;
-  if (ar->topic > br->topic)
-    return 1;
-  return ar->rank - br->rank;
-}
-
-/* resultSortByRank:
-     sort results, first by topic and then by rank
-*/
-static void
-resultSortByRank (struct result *list, int results)
-{
-  qsort (list, results, sizeof (struct result), resultCompareByRank);
-}
-
-
 /* resultCompareByDocno:
      qsort comparison funtion for results; sort by topic and then by docno
 */
@@ -427,167 +635,625 @@ applyCutoff (struct result *r, int n, int depthMax)
   return j;
 }
 
-/* loadRun:
-        load a run from a named file; perform initial cleaning and sorting
+/*
+  Topic selection.  With --topics, only the listed topics are evaluated.
+  Plain (uncompressed) input files then get a sidecar index, named by
+  appending INDEX_SUFFIX, that maps each topic to the byte ranges holding
+  its lines, so only those bytes need to be read.  The index is built the
+  first time it's needed (or by "med index"), and rebuilt whenever the
+  size, the modification time (to the nanosecond), the inode or the
+  device of the indexed file changes.
 */
-static struct result *
-loadRun (char *run, int *size)
-{
-  FILE *fp;
-  char *line, *runid;
-  int i = 0, n = 0, needRunID = 1;
-  struct result *r;
 
-  if ((fp = fopen (run, "r")) == NULL)
-    error ("cannot open run file \"%s\"\n", run);
+#define INDEX_SUFFIX ".medx"
+#define INDEX_MAGIC "medx2"
 
-  while (getLine (fp))
-    n++;
+/* topicFilter: sorted topics to evaluate; all topics if topicFilterSize is 0 */
+static int *topicFilter = (int *) 0;
+static int topicFilterSize = 0;
 
-  fclose (fp);
+/* struct topicRange:
+        A stretch of consecutive lines for one topic in an input file.
+        offset = byte offset of the first line
+        line   = line number of the first line (for error messages)
+        lines  = number of lines in the stretch
+*/
+struct topicRange {
+  long long offset;
+  int topic, line, lines;
+};
 
-  if (n == 0)
-    error ("run file \"%s\" is empty\n", run);
+/* struct input:
+        A file being loaded, read either in full or, through an index, as
+        the ranges of selected topics only.
+*/
+struct input {
+  char *name;
+  FILE *fp;
+  pid_t decoder;
+  struct topicRange *range;
+  int ranges, nextRange, linesLeft;
+  int line;
+};
 
-  r = localMalloc (n*sizeof (struct result));
+static int
+compareInt (const void *a, const void *b)
+{
+  int ai = *(int *) a, bi = *(int *) b;
+  return (ai > bi) - (ai < bi);
+}
 
-  if ((fp = fopen (run, "r")) == NULL)
-    error ("cannot open run file \"%s\"\n", run);
+/* topicSelected:
+        Should this topic be evaluated?
+*/
+static int
+topicSelected (int topic)
+{
+  return topicFilterSize == 0
+    || bsearch (
+         &topic, topicFilter, topicFilterSize, sizeof (int), compareInt
+       ) != NULL;
+}
 
-  while ((line = getLine (fp)))
+/* addTopics:
+        Add topics to the filter from a list like "301,305,310-350".
+        Returns 0 if the list is malformed.
+*/
+static int
+addTopics (char *list)
+{
+  static int max = 0;
+  char *item;
+
+  for (item = strtok (list, ", \t\r\n"); item; item = strtok (NULL, ", \t\r\n"))
     {
-      char *a[6];
-      int topic, rank;
+      char *dash = strchr (item, '-');
+      int first, last;
 
-      if (
-        split (line, a, 6) != 6
-        || (topic = naturalNumber (a[0])) < 0
-        || (rank = naturalNumber (a[3])) < 0
-      )
-        error ("syntax error in run file \"%s\" at line %d\n", run, i + 1);
-      else
+      if (dash)
+        *dash++ = '\0';
+      if ((first = naturalNumber (item)) < 0)
+        return 0;
+      if ((last = (dash ? naturalNumber (dash) : first)) < first)
+        return 0;
+
+      for (; first <= last; first++)
         {
-         if (needRunID)
+          if (topicFilterSize == max)
             {
-              runid = localStrdup (a[5]);
-              needRunID = 0;
+              max = (max ? 2*max : 64);
+              topicFilter = localRealloc (topicFilter, max*sizeof (int));
             }
-          r[i].docno = localStrdup (a[2]);
-          r[i].runid = runid;
-          r[i].topic = topic;
-          r[i].rank = rank;
-          r[i].rankx = -1;
-          r[i].rel = -1;
-          sscanf (a[4],"%lf", &(r[i].score));
-          i++;
+          topicFilter[topicFilterSize++] = first;
         }
     }
 
-  /* force ranks to be consistent with traditional TREC sort order */
-  forceTraditionalRanks (r, n);
+  return 1;
+}
 
-  /*
-    apply depth cutoff
-    (Why am I doing this work, if I now have a per-measure depth?)
-  */
-  n = applyCutoff (r, n, DEPTH);
+/* setTopics:
+        Set the topic filter from a --topics argument: either a list for
+        addTopics or "@file" naming a file of such lists.
+*/
+static void
+setTopics (char *spec)
+{
+  int i, j;
 
+  if (*spec == '@')
+    {
+      FILE *fp;
+      char *line;
+
+      if ((fp = fopen (spec + 1, "r")) == NULL)
+        error ("cannot open topic file \"%s\"\n", spec + 1);
+      while ((line = getLine (fp)))
+        if (!addTopics (line))
+          error ("bad topic list in \"%s\"\n", spec + 1);
+      fclose (fp);
+    }
+  else if (!addTopics (spec))
+    error ("bad topic list \"%s\"\n", spec);
 
-  /* for each topic, verify that docnos have not been duplicated */
-  resultSortByDocno (r, n);
-  for (i = 1; i < n; i++)
-    if (r[i].topic == r[i-1].topic && strcmp(r[i].docno,r[i-1].docno) == 0)
-      error (
-        "duplicate docno (%s) for topic %d in run file \"%s\"\n",
-        r[i].docno, r[i].topic, run
-      );
+  if (topicFilterSize == 0)
+    error ("no topics selected\n");
+
+  qsort (topicFilter, topicFilterSize, sizeof (int), compareInt);
+  for (i = j = 1; i < topicFilterSize; i++)
+    if (topicFilter[i] != topicFilter[j - 1])
+      topicFilter[j++] = topicFilter[i];
+  topicFilterSize = j;
+}
+
+static int
+compareRange (const void *a, const void *b)
+{
+  struct topicRange *ar = (struct topicRange *) a;
+  struct topicRange *br = (struct topicRange *) b;
+  if (ar->topic != br->topic)
+    return (ar->topic > br->topic) - (ar->topic < br->topic);
+  return (ar->offset > br->offset) - (ar->offset < br->offset);
+}
+
+/* indexScan:
+        Find the topic ranges of a plain file, positioned at its start.
+        Returns NULL if a line has no valid topic; the caller falls back to
+        reading the file in full, which reports the error properly.
+*/
+static struct topicRange *
+indexScan (FILE *fp, int *size)
+{
+  int n = 0, max = 1024, line = 0, currentTopic = -1;
+  struct topicRange *range = localMalloc (max*sizeof (struct topicRange));
+  long long offset = 0;
+  char *s;
+
+  while ((s = getLine (fp)))
+    {
+      char *a[1];
+      int topic;
+
+      line++;
+      if (trecSplit (s, a, 1) != 1 || (topic = naturalNumber (a[0])) < 0)
+        return localFree (range);
 
+      if (topic != currentTopic)
+        {
+          if (n == max)
+            {
+              max *= 2;
+              range = localRealloc (range, max*sizeof (struct topicRange));
+            }
+          range[n].topic = currentTopic = topic;
+          range[n].offset = offset;
+          range[n].line = line;
+          range[n].lines = 0;
+          n++;
+        }
+      range[n - 1].lines++;
+      offset = ftello (fp);
+    }
+
+  qsort (range, n, sizeof (struct topicRange), compareRange);
   *size = n;
-  return r;
+  return range;
 }
 
-/* loadQ:
-        load qrels from a named file; sort by topic then docno
+static char *
+indexName (char *name)
+{
+  char *index = localMalloc (strlen (name) + strlen (INDEX_SUFFIX) + 1);
+
+  strcpy (index, name);
+  return strcat (index, INDEX_SUFFIX);
+}
+
+/* fileMtimeNsec:
+        Nanoseconds of a file's modification time, or 0 where stat
+        doesn't give them.
 */
-static struct qrel *
-loadQ (char *qrels, int *size)
+static long
+fileMtimeNsec (struct stat *st)
 {
-  FILE *fp;
-  char *line;
-  struct qrel *q;
-  int i = 0, n = 0;
+#if defined(__APPLE__)
+  return (long) st->st_mtimespec.tv_nsec;
+#elif defined(st_mtime)
+  /* st_mtime is a macro for st_mtim.tv_sec where st_mtim exists */
+  return (long) st->st_mtim.tv_nsec;
+#else
+  return 0L;
+#endif
+}
 
-  if ((fp = fopen (qrels, "r")) == NULL)
-    error ("cannot open qrels file \"%s\"\n", qrels);
+/* indexWrite:
+        Write the sidecar index for a file.  The index goes to a temporary
+        name first and is renamed into place, so concurrent jobs never see
+        a partial index.  Returns 0 on failure.
+*/
+static int
+indexWrite (char *name, struct stat *st, struct topicRange *range, int n)
+{
+  char *index = indexName (name);
+  char *temp = localMalloc (strlen (index) + 32);
+  FILE *fp;
+  int i, ok;
 
-  while (getLine (fp))
-    n++;
+  sprintf (temp, "%s.%ld", index, (long) getpid ());
+  if ((fp = fopen (temp, "w")) == NULL)
+    {
+      localFree (temp);
+      localFree (index);
+      return 0;
+    }
 
-  fclose (fp);
+  fprintf (
+    fp, "%s %lld %lld %ld %llu %llu\n", INDEX_MAGIC,
+    (long long) st->st_size, (long long) st->st_mtime,
+    fileMtimeNsec (st), (unsigned long long) st->st_ino,
+    (unsigned long long) st->st_dev
+  );
+  for (i = 0; i < n; i++)
+    fprintf (
+      fp, "%d %lld %d %d\n",
+      range[i].topic, range[i].offset, range[i].line, range[i].lines
+    );
 
-  if (n == 0)
-    error ("qrel file \"%s\" is empty\n", qrels);
+  ok = (fclose (fp) == 0 && rename (temp, index) == 0);
+  if (!ok)
+    unlink (temp);
+  localFree (temp);
+  localFree (index);
+  return ok;
+}
 
-  q = localMalloc (n*sizeof (struct qrel));
+/* indexRead:
+        Read the sidecar index for a file.  Returns NULL if there is none,
+        or if it's malformed or out of date.
+*/
+static struct topicRange *
+indexRead (char *name, struct stat *st, int *size)
+{
+  struct topicRange *range;
+  int n = 0, max = 1024;
+  char *index = indexName (name);
+  char *line, *a[6];
+  FILE *fp;
 
-  if ((fp = fopen (qrels, "r")) == NULL)
-    error ("cannot open qrels file \"%s\"\n", qrels);
+  fp = fopen (index, "r");
+  localFree (index);
+  if (fp == NULL)
+    return (struct topicRange *) 0;
+
+  if (
+    (line = getLine (fp)) == NULL || trecSplit (line, a, 6) != 6
+    || strcmp (a[0], INDEX_MAGIC) != 0
+    || strtoll (a[1], NULL, 10) != (long long) st->st_size
+    || strtoll (a[2], NULL, 10) != (long long) st->st_mtime
+    || strtol (a[3], NULL, 10) != fileMtimeNsec (st)
+    || strtoull (a[4], NULL, 10) != (unsigned long long) st->st_ino
+    || strtoull (a[5], NULL, 10) != (unsigned long long) st->st_dev
+  )
+    {
+      fclose (fp);
+      return (struct topicRange *) 0;
+    }
 
+  range = localMalloc (max*sizeof (struct topicRange));
   while ((line = getLine (fp)))
     {
-      char *a[4];
-      int topic, rel;
-
+      if (n == max)
+        {
+          max *= 2;
+          range = localRealloc (range, max*sizeof (struct topicRange));
+        }
       if (
-        split (line, a, 4) != 4
-        || (topic = naturalNumber (a[0])) < 0
-        || (rel = naturalNumber (a[3])) < 0
+        trecSplit (line, a, 4) != 4
+        || (range[n].topic = naturalNumber (a[0])) < 0
+        || (range[n].offset = strtoll (a[1], NULL, 10)) < 0
+        || (range[n].line = naturalNumber (a[2])) < 0
+        || (range[n].lines = naturalNumber (a[3])) < 0
       )
-        error ("syntax error in qrel file \"%s\" at line %d\n", qrels, i + 1);
-      else
         {
-          q[i].docno = localStrdup (a[2]);
-          q[i].topic = topic;
-          if (rel > G)
-            rel = G;
-          q[i].rel = rel;
-          i++;
+          fclose (fp);
+          return localFree (range);
         }
+      n++;
     }
 
-
-  /* for each topic, verify that docnos have not been duplicated */
-  sortQ (q, n);
-  for (i = 1; i < n; i++)
-    if (q[i].topic == q[i-1].topic && strcmp(q[i].docno,q[i-1].docno) == 0)
-      error (
-        "duplicate docno (%s) for topic %d in qrels file \"%s\"\n",
-        q[i].docno, q[i].topic, qrels
-      );
-
+  fclose (fp);
   *size = n;
-  return q;
+  return range;
 }
 
-/* labelQ:
-        label a run with pre-determined relevance values
+/* indexSelect:
+        Topic ranges of the selected topics in a plain file, from its
+        index, building the index if necessary.  Returns NULL if the file
+        can't be indexed.
 */
-static void
-labelQ (struct result *r, int results, struct qrel *q, int qrels)
+static struct topicRange *
+indexSelect (char *name, FILE *fp, int *size)
 {
-  int i = 0, j = 0;
+  struct topicRange *range;
+  struct stat st;
+  int i, j, n;
 
-  while (i < results && j < qrels)
-    if (r[i].topic < q[j].topic)
-      i++;
-    else if (r[i].topic > q[j].topic)
-      j++;
-    else
-      {
-        int cmp = strcmp (r[i].docno, q[j].docno);
+  if (fstat (fileno (fp), &st) < 0)
+    return (struct topicRange *) 0;
 
-        if (cmp < 0)
-          i++;
+  if ((range = indexRead (name, &st, &n)) == NULL)
+    {
+      if ((range = indexScan (fp, &n)) == NULL)
+        return range;
+      indexWrite (name, &st, range, n); /* just a cache, so failure is OK */
+    }
+
+  for (i = j = 0; i < n; i++)
+    if (topicSelected (range[i].topic))
+      range[j++] = range[i];
+
+  *size = j;
+  return range;
+}
+
+/* inputOpen:
+        Open a run or qrels file for loading.  Returns NULL if it can't be
+        opened.
+*/
+static struct input *
+inputOpen (char *name)
+{
+  struct input *in;
+  FILE *fp;
+  pid_t decoder;
+
+  if ((fp = openInput (name, &decoder)) == NULL)
+    return (struct input *) 0;
+
+  in = localMalloc (sizeof (struct input));
+  in->name = name;
+  in->fp = fp;
+  in->decoder = decoder;
+  in->range = (struct topicRange *) 0;
+  in->ranges = in->nextRange = in->linesLeft = in->line = 0;
+
+  if (topicFilterSize > 0 && decoder == 0)
+    {
+      in->range = indexSelect (name, fp, &(in->ranges));
+      if (in->range == NULL)
+        rewind (fp);
+    }
+
+  return in;
+}
+
+/* inputLine:
+        Next line of an input, or NULL at the end.  in->line is its number.
+*/
+static char *
+inputLine (struct input *in)
+{
+  if (in->range)
+    {
+      while (in->linesLeft == 0)
+        {
+          struct topicRange *range = in->range + in->nextRange;
+
+          if (in->nextRange == in->ranges)
+            return (char *) 0;
+          if (fseeko (in->fp, range->offset, SEEK_SET) < 0)
+            error ("cannot seek in \"%s\"\n", in->name);
+          in->line = range->line - 1;
+          in->linesLeft = range->lines;
+          in->nextRange++;
+        }
+      in->linesLeft--;
+    }
+
+  in->line++;
+  return getLine (in->fp);
+}
+
+static void
+inputClose (struct input *in)
+{
+  closeInput (in->fp, in->decoder, in->name);
+  localFree (in->range);
+  localFree (in);
+}
+
+/* indexFiles:
+        The "index" subcommand: build sidecar indexes for the named files.
+*/
+static void
+indexFiles (int n, char **name)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      struct topicRange *range;
+      struct stat st;
+      pid_t decoder;
+      FILE *fp;
+      int size;
+
+      if ((fp = openInput (name[i], &decoder)) == NULL)
+        error ("cannot open \"%s\"\n", name[i]);
+      if (decoder)
+        error ("cannot index compressed file \"%s\"\n", name[i]);
+      if (fstat (fileno (fp), &st) < 0)
+        error ("cannot stat \"%s\"\n", name[i]);
+      if ((range = indexScan (fp, &size)) == NULL)
+        error ("syntax error in \"%s\"; not indexed\n", name[i]);
+      if (!indexWrite (name[i], &st, range, size))
+        error ("cannot write index for \"%s\"\n", name[i]);
+      closeInput (fp, decoder, name[i]);
+      localFree (range);
+    }
+}
+
+/* readResult:
+        Read the next result of a selected topic from a run into *r; returns
+        0 at the end of the run.  *runid is set from the first result read,
+        and shared by the rest.
+*/
+static int
+readResult (struct input *in, char **runid, struct result *r)
+{
+  char *line;
+
+  while ((line = inputLine (in)))
+    {
+      char *a[6];
+      int topic, rank;
+
+      if (
+        trecSplit (line, a, 6) != 6
+        || (topic = naturalNumber (a[0])) < 0
+        || (rank = naturalNumber (a[3])) < 0
+      )
+        error (
+          "syntax error in run file \"%s\" at line %d\n", in->name, in->line
+        );
+      else if (topicSelected (topic))
+        {
+          if (*runid == NULL)
+            *runid = localStrdup (a[5]);
+          r->docno = localStrdup (a[2]);
+          r->runid = *runid;
+          r->topic = topic;
+          r->rank = rank;
+          r->rankx = -1;
+          r->rel = -1;
+          r->score = trecScore (a[4]);
+          return 1;
+        }
+    }
+
+  return 0;
+}
+
+/* loadRun:
+        load a run from a named file; perform initial cleaning and sorting
+*/
+static struct result *
+loadRun (char *run, int *size)
+{
+  struct input *in;
+  char *runid = (char *) 0;
+  int i = 0, n = 0;
+  struct result *r = (struct result *) 0;
+
+  /* one pass only, since a compressed file would have to be decoded twice */
+  if ((in = inputOpen (run)) == NULL)
+    error ("cannot open run file \"%s\"\n", run);
+
+  for (;;)
+    {
+      if (i == n)
+        {
+          n = (n ? 2*n : 1024);
+          r = localRealloc (r, n*sizeof (struct result));
+        }
+      if (!readResult (in, &runid, r + i))
+        break;
+      i++;
+    }
+
+  inputClose (in);
+
+  if (i == 0 && topicFilterSize > 0)
+    error ("no selected topics in run file \"%s\"\n", run);
+  if (i == 0)
+    error ("run file \"%s\" is empty\n", run);
+  n = i;
+
+  /* force ranks to be consistent with traditional TREC sort order */
+  forceTraditionalRanks (r, n);
+
+  /*
+    apply depth cutoff
+    (Why am I doing this work, if I now have a per-measure depth?)
+  */
+  n = applyCutoff (r, n, DEPTH);
+
+
+  /* for each topic, verify that docnos have not been duplicated */
+  resultSortByDocno (r, n);
+  for (i = 1; i < n; i++)
+    if (r[i].topic == r[i-1].topic && strcmp(r[i].docno,r[i-1].docno) == 0)
+      error (
+        "duplicate docno (%s) for topic %d in run file \"%s\"\n",
+        r[i].docno, r[i].topic, run
+      );
+
+  *size = n;
+  return r;
+}
+
+/* loadQ:
+        load qrels from a named file; sort by topic then docno
+*/
+static struct qrel *
+loadQ (char *qrels, int *size)
+{
+  struct input *in;
+  char *line;
+  struct qrel *q = (struct qrel *) 0;
+  int i = 0, n = 0;
+
+  if ((in = inputOpen (qrels)) == NULL)
+    error ("cannot open qrels file \"%s\"\n", qrels);
+
+  while ((line = inputLine (in)))
+    {
+      char *a[4];
+      int topic, rel;
+
+      if (i == n)
+        {
+          n = (n ? 2*n : 1024);
+          q = localRealloc (q, n*sizeof (struct qrel));
+        }
+
+      if (
+        trecSplit (line, a, 4) != 4
+        || (topic = naturalNumber (a[0])) < 0
+        || (rel = naturalNumber (a[3])) < 0
+      )
+        error (
+          "syntax error in qrel file \"%s\" at line %d\n", qrels, in->line
+        );
+      else if (topicSelected (topic))
+        {
+          q[i].docno = localStrdup (a[2]);
+          q[i].topic = topic;
+          if (rel > G)
+            rel = G;
+          q[i].rel = rel;
+          i++;
+        }
+    }
+
+  inputClose (in);
+
+  /* with --topics, the qrels needn't cover any of the selected topics */
+  if (i == 0 && topicFilterSize == 0)
+    error ("qrel file \"%s\" is empty\n", qrels);
+  n = i;
+
+  /* for each topic, verify that docnos have not been duplicated */
+  sortQ (q, n);
+  for (i = 1; i < n; i++)
+    if (q[i].topic == q[i-1].topic && strcmp(q[i].docno,q[i-1].docno) == 0)
+      error (
+        "duplicate docno (%s) for topic %d in qrels file \"%s\"\n",
+        q[i].docno, q[i].topic, qrels
+      );
+
+  *size = n;
+  return q;
+}
+
+/* labelQ:
+        label a run with pre-determined relevance values
+*/
+static void
+labelQ (struct result *r, int results, struct qrel *q, int qrels)
+{
+  int i = 0, j = 0;
+
+  while (i < results && j < qrels)
+    if (r[i].topic < q[j].topic)
+      i++;
+    else if (r[i].topic > q[j].topic)
+      j++;
+    else
+      {
+        int cmp = strcmp (r[i].docno, q[j].docno);
+
+        if (cmp < 0)
+          i++;
         else if (cmp > 0)
           j++;
         else
@@ -690,6 +1356,46 @@ errComputeDiff (struct result *r, int size, struct result *rx, int sizex)
   return fabs(score - scorex);
 }
 
+/*
+  ERR search budget.  With --err-nodes or --err-usec, the search in errHalf
+  stops once it has visited that many nodes or run that long for a topic,
+  and errMaximize reports the best value found so far together with an
+  upper bound on the exact value.
+*/
+static long errNodeLimit = 0, errUsecLimit = 0;
+static long errNodes;
+static int errBudgetHit;
+static struct timespec errStart;
+
+/* errOverBudget:
+        Count a search node; true if the budget for this topic is spent.
+        The clock is only read every 256 nodes.
+*/
+static int
+errOverBudget (void)
+{
+  struct timespec now;
+
+  if (errBudgetHit)
+    return 1;
+
+  errNodes++;
+  if (errNodeLimit > 0 && errNodes > errNodeLimit)
+    return errBudgetHit = 1;
+
+  if (errUsecLimit > 0 && (errNodes & 255) == 0)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (
+        (now.tv_sec - errStart.tv_sec)*1000000L
+        + (now.tv_nsec - errStart.tv_nsec)/1000L > errUsecLimit
+      )
+        return errBudgetHit = 1;
+    }
+
+  return 0;
+}
+
 /* errHalf:
         Compute ERR difference between one result list and another.
         Up to p bound variables may be set starting at a given depth.
@@ -708,6 +1414,8 @@ errHalf (
   for (i = start; i < size; i++)
     if (r[i].rel == -1)
       {
+        if (errOverBudget ())
+          break;
         if (r[i].rankx > 0 && r[i].rankx <= sizex) /* bound */
           {
             r[i].rel = rx[r[i].rankx - 1].rel = G; /* let's pretend */
@@ -728,18 +1436,59 @@ errHalf (
   return max;
 }
 
+/* errUpperBound:
+        Upper bound on the maximized ERR difference.  With sizex set to
+        zero, errCompute gives every undetermined document the same grade,
+        whether bound or free.  ERR never decreases when a document's
+        relevance goes up, so no assignment can beat making every
+        undetermined document fully relevant in one list and non-relevant
+        in the other, even though a bound document can't really be both.
+*/
+static double
+errUpperBound (struct result *r1, int size1, struct result *r2, int size2)
+{
+  double bound1 = errCompute (r1, size1, 0, G) - errCompute (r2, size2, 0, 0);
+  double bound2 = errCompute (r2, size2, 0, G) - errCompute (r1, size1, 0, 0);
+
+  return (bound1 > bound2 ? bound1 : bound2);
+}
+
+/* errMaximize:
+        Maximized ERR difference.  If the search budget runs out, the best
+        value found so far is returned, *truncated is set, and *bound is an
+        upper bound on the exact value; otherwise *bound is the value itself.
+*/
 static double
-errMaximize (struct result *r1, int size1, struct result *r2, int size2)
+errMaximize (
+  struct result *r1, int size1, struct result *r2, int size2,
+  double *bound, int *truncated
+)
 {
-  double max1, max2;
+  double max1, max2, max;
 
   if (size1 > ERR_DEPTH) size1 = ERR_DEPTH;
   if (size2 > ERR_DEPTH) size2 = ERR_DEPTH;
 
+  errNodes = 0;
+  errBudgetHit = 0;
+  if (errUsecLimit > 0)
+    clock_gettime (CLOCK_MONOTONIC, &errStart);
+
   max1 = errHalf (r1, size1, r2, size2, P, 0);
   max2 = errHalf (r2, size2, r1, size1, P, 0);
+  max = (max1 > max2 ? max1 : max2);
+
+  *truncated = errBudgetHit;
+  *bound = max;
+  if (errBudgetHit)
+    {
+      double upper = errUpperBound (r1, size1, r2, size2);
 
-  return (max1 > max2 ? max1 : max2);
+      if (*bound < upper)
+        *bound = upper;
+    }
+
+  return max;
 }
 
 static double
@@ -843,87 +1592,2281 @@ ndcgMaximize (struct result *r1, int size1, struct result *r2, int size2)
   return (max1 > max2 ? max1 : max2)/norm;
 }
 
-static void
-med (char *run1, char *run2, char *qrels)
-{
-  int i, j, n = 0;
-  int topic1, topic2, size1, size2;
-  struct result *r1, *r2;
-  char *runid1, *runid2;
-  double err_max = 0.0, err_tot = 0.0;
-  double rbp_max = 0.0, rbp_tot = 0.0;
-  double ndcg_max = 0.0, ndcg_tot = 0.0;
+/*
+  Bootstrap confidence intervals.  With --bootstrap B, the per-topic MED
+  values are kept and B resamples of the topics are drawn to give
+  percentile confidence intervals for the amean row.
+*/
 
-  printf ("run1,run2,topic,MED-nDCG@%d,MED-RBP,MED-ERR\n", NDCG_DEPTH);
+/* BOOTSTRAP_CONFIDENCE: Coverage of the bootstrap confidence intervals. */
+#define BOOTSTRAP_CONFIDENCE 0.95
 
-  r1 = loadRun (run1, &size1);
-  runid1 = r1[0].runid;
-  r2 = loadRun (run2, &size2);
-  runid2 = r2[0].runid;
+static int bootstrapSamples = 0;
+static uint64_t bootstrapSeed = 1;
 
-  if (size1 <= 0 || size2 <= 0)
-    {
-      printf ("%s,%s,0.0,0.0,0.0\n", runid1, runid2);
-      return;
-    }
+/* struct medValues:
+        MED values for one topic, kept together so that a resample touches
+        a single record per draw.
+*/
+struct medValues {
+  double ndcg, rbp, err;
+};
 
-  if (qrels)
-    {
-      struct qrel *q;
-      int sizeQ;
+/* splitmix64:
+        Small, fast, seedable PRNG (Steele, Lea and Flood).
+*/
+static uint64_t
+splitmix64 (uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
 
-      q = loadQ (qrels, &sizeQ);
-      labelQ (r1, size1, q, sizeQ);
-      labelQ (r2, size2, q, sizeQ);
-    }
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static int
+compareDouble (const void *a, const void *b)
+{
+  double ad = *(double *) a, bd = *(double *) b;
+  return (ad > bd) - (ad < bd);
+}
 
-  crossLabelRuns (r1, size1, r2, size2);
+/* The B resamples are drawn in streams of BOOTSTRAP_STREAM, each from its
+   own splitmix64 state derived from the seed and the stream number, so
+   the intervals don't depend on how the streams are spread over threads.
+   Jobs of fewer than BOOTSTRAP_THREAD_DRAWS draws per thread aren't worth
+   a thread. */
+#define BOOTSTRAP_STREAM 64
+#define BOOTSTRAP_THREAD_DRAWS (1 << 18)
+#define BOOTSTRAP_THREADS 64
+
+/* struct bootstrapJob:
+        Streams first to last - 1 of a bootstrap, for one thread.
+*/
+struct bootstrapJob {
+  struct medValues *v;
+  int n, B, first, last;
+  double *ndcg, *rbp, *err;
+};
 
-  /* sort results into rank order. */
-  resultSortByRank (r1, size1);
-  resultSortByRank (r2, size2);
+static void *
+bootstrapDraws (void *arg)
+{
+  struct bootstrapJob *job = arg;
+  struct medValues *v = job->v;
+  int b, k, s, end, n = job->n;
 
-  while (size1 > 0 && size2 > 0)
+  for (s = job->first; s < job->last; s++)
     {
-      i = nextTopicSize (r1, size1, &topic1);
-      j = nextTopicSize (r2, size2, &topic2);
-      if (topic1 < topic2)
-        {
-          r1 += i;
-          size1 -= i;
-        }
-      else if (topic1 > topic2)
-        {
-          r2 += j;
-          size2 -= j;
-        }
-      else
+      uint64_t state = bootstrapSeed + (uint64_t) s*0xd1b54a32d192ed03ULL;
+
+      state = splitmix64 (&state);
+      end = (s + 1)*BOOTSTRAP_STREAM;
+      if (end > job->B)
+        end = job->B;
+      for (b = s*BOOTSTRAP_STREAM; b < end; b++)
         {
-          ndcg_max = ndcgMaximize (r1, i, r2, j);
-          ndcg_tot += ndcg_max;
-          rbp_max = rbpMaximize (r1, i, r2, j);
-          rbp_tot += rbp_max;
-          err_max = errMaximize (r1, i, r2, j);
-          err_tot += err_max;
-          printf (
-            "%s,%s,%d,%.5f,%.5f,%.5f\n",
-            runid1, runid2, topic1, ndcg_max, rbp_max, err_max
-          );
-          n++;
-          r1 += i;
-          size1 -= i;
-          r2 += j;
-          size2 -= j;
+          double ndcg_sum = 0.0, rbp_sum = 0.0, err_sum = 0.0;
+
+          for (k = 0; k < n; k++)
+            {
+              /* multiply-shift maps 32 random bits onto [0, n) */
+              struct medValues *x =
+                v + (((splitmix64 (&state) >> 32)*(uint64_t) n) >> 32);
+
+              ndcg_sum += x->ndcg;
+              rbp_sum += x->rbp;
+              err_sum += x->err;
+            }
+          job->ndcg[b] = ndcg_sum/n;
+          job->rbp[b] = rbp_sum/n;
+          job->err[b] = err_sum/n;
         }
     }
 
-    if (n > 0)
-      printf (
-        "%s,%s,amean,%.5f,%.5f,%.5f\n",
-        runid1, runid2, ndcg_tot/n, rbp_tot/n, err_tot/n
-      );
-    else
-      printf ("%s,%s,amean,0.00000,0.00000,0.00000\n", runid1, runid2);
+  return (void *) 0;
+}
+
+/* bootstrap:
+        Percentile bootstrap intervals for the mean of each measure over n
+        topics.  All three measures are accumulated from the same draws,
+        which are spread over up to one thread per processor.
+*/
+static void
+bootstrap (
+  struct medValues *v, int n, struct medValues *lo, struct medValues *hi
+)
+{
+  int t, B = bootstrapSamples, threads;
+  int streams = (B + BOOTSTRAP_STREAM - 1)/BOOTSTRAP_STREAM;
+  int low = (int) ((1.0 - BOOTSTRAP_CONFIDENCE)/2.0*B), high = B - 1 - low;
+  double *ndcg = localMalloc (3*B*sizeof (double));
+  double *rbp = ndcg + B, *err = rbp + B;
+  struct bootstrapJob job[BOOTSTRAP_THREADS];
+  pthread_t thread[BOOTSTRAP_THREADS];
+  int started[BOOTSTRAP_THREADS];
+  long processors = sysconf (_SC_NPROCESSORS_ONLN);
+
+  threads = (int) ((double) B*n/BOOTSTRAP_THREAD_DRAWS) + 1;
+  if (processors > 0 && threads > processors)
+    threads = (int) processors;
+  if (threads > streams)
+    threads = streams;
+  if (threads > BOOTSTRAP_THREADS)
+    threads = BOOTSTRAP_THREADS;
+
+  for (t = 0; t < threads; t++)
+    {
+      job[t].v = v;
+      job[t].n = n;
+      job[t].B = B;
+      job[t].first = (int) ((long long) streams*t/threads);
+      job[t].last = (int) ((long long) streams*(t + 1)/threads);
+      job[t].ndcg = ndcg;
+      job[t].rbp = rbp;
+      job[t].err = err;
+      /* the calling thread takes the first job, and any that can't start */
+      started[t] = (
+        t > 0 && pthread_create (thread + t, NULL, bootstrapDraws, job + t) == 0
+      );
+    }
+  for (t = 0; t < threads; t++)
+    if (!started[t])
+      bootstrapDraws (job + t);
+  for (t = 1; t < threads; t++)
+    if (started[t])
+      pthread_join (thread[t], NULL);
+
+  qsort (ndcg, B, sizeof (double), compareDouble);
+  qsort (rbp, B, sizeof (double), compareDouble);
+  qsort (err, B, sizeof (double), compareDouble);
+  lo->ndcg = ndcg[low];
+  hi->ndcg = ndcg[high];
+  lo->rbp = rbp[low];
+  hi->rbp = rbp[high];
+  lo->err = err[low];
+  hi->err = err[high];
+
+  localFree (ndcg);
+}
+
+/*
+  Binary output.  With --binary file, per-topic values go to a columnar
+  file instead of the CSV, which then carries only the amean rows.  The
+  layout, in native byte order, is meant to be mmapped by readers:
+
+    header   8-byte magic "MEDBIN2", then uint32 0x01020304 (byte order
+             check) and uint32 BINARY_BLOCK
+    blocks   for each group of up to BINARY_BLOCK rows, the columns
+             uint32 run1[k], uint32 run2[k], int32 topic[k],
+             float ndcg[k], float rbp[k], float err[k]
+             and, if flags has BINARY_ERR_BOUND,
+             float errBound[k], uint32 errTruncated[k]
+             where k is BINARY_BLOCK except in the last block
+    runs     run dictionary: the NUL-terminated runid of each run, in
+             order of run number, padded with NULs to a multiple of 8
+    trailer  uint64 rows, uint64 offset of the run dictionary,
+             uint32 runs, uint32 NDCG_DEPTH, uint32 flags, uint32 0,
+             8-byte magic "MEDBIN2"
+
+  A row takes 24 bytes, or 32 with BINARY_ERR_BOUND, so block b starts
+  at 16 + rowBytes*BINARY_BLOCK*b.  BINARY_ERR_BOUND is set when the
+  MED-ERR search has a budget (--err-nodes or --err-usec).
+*/
+
+#define BINARY_BLOCK 65536
+#define BINARY_MAGIC "MEDBIN2"
+#define BINARY_ERR_BOUND 1
+
+static char *binaryName = (char *) 0;
+
+static struct {
+  FILE *fp;
+  uint32_t *run1, *run2;
+  int32_t *topic;
+  float *ndcg, *rbp, *err, *errBound;
+  uint32_t *errTruncated, flags;
+  int fill;
+  uint64_t rows;
+  char **runid;
+  int runs;
+} binary;
+
+static void
+binaryWrite (void *data, size_t size)
+{
+  if (size > 0 && fwrite (data, size, 1, binary.fp) != 1)
+    error ("cannot write binary output \"%s\"\n", binaryName);
+}
+
+static void
+binaryOpen (void)
+{
+  uint32_t order = 0x01020304, block = BINARY_BLOCK;
+
+  if ((binary.fp = fopen (binaryName, "wb")) == NULL)
+    error ("cannot open binary output \"%s\"\n", binaryName);
+  setvbuf (binary.fp, (char *) 0, _IOFBF, 1 << 20);
+
+  binary.run1 = localMalloc (BINARY_BLOCK*sizeof (uint32_t));
+  binary.run2 = localMalloc (BINARY_BLOCK*sizeof (uint32_t));
+  binary.topic = localMalloc (BINARY_BLOCK*sizeof (int32_t));
+  binary.ndcg = localMalloc (BINARY_BLOCK*sizeof (float));
+  binary.rbp = localMalloc (BINARY_BLOCK*sizeof (float));
+  binary.err = localMalloc (BINARY_BLOCK*sizeof (float));
+  binary.errBound = localMalloc (BINARY_BLOCK*sizeof (float));
+  binary.errTruncated = localMalloc (BINARY_BLOCK*sizeof (uint32_t));
+  binary.flags = (errNodeLimit > 0 || errUsecLimit > 0 ? BINARY_ERR_BOUND : 0);
+  binary.fill = 0;
+  binary.rows = 0;
+  binary.runid = (char **) 0;
+  binary.runs = 0;
+
+  binaryWrite (BINARY_MAGIC, 8);
+  binaryWrite (&order, sizeof (order));
+  binaryWrite (&block, sizeof (block));
+}
+
+/* binaryRun:
+        Add a run to the run dictionary; returns its run number.
+*/
+static uint32_t
+binaryRun (char *runid)
+{
+  binary.runid = localRealloc (binary.runid, (binary.runs + 1)*sizeof (char *));
+  binary.runid[binary.runs] = runid;
+  return binary.runs++;
+}
+
+static void
+binaryFlush (void)
+{
+  int k = binary.fill;
+
+  binaryWrite (binary.run1, k*sizeof (uint32_t));
+  binaryWrite (binary.run2, k*sizeof (uint32_t));
+  binaryWrite (binary.topic, k*sizeof (int32_t));
+  binaryWrite (binary.ndcg, k*sizeof (float));
+  binaryWrite (binary.rbp, k*sizeof (float));
+  binaryWrite (binary.err, k*sizeof (float));
+  if (binary.flags & BINARY_ERR_BOUND)
+    {
+      binaryWrite (binary.errBound, k*sizeof (float));
+      binaryWrite (binary.errTruncated, k*sizeof (uint32_t));
+    }
+  binary.fill = 0;
+}
+
+/* binaryRow:
+        Add a row of standard values: MED-nDCG, MED-RBP, MED-ERR, the bound
+        on MED-ERR and whether its search was truncated.
+*/
+static void
+binaryRow (uint32_t run1, uint32_t run2, int topic, double *value)
+{
+  int k = binary.fill++;
+
+  binary.run1[k] = run1;
+  binary.run2[k] = run2;
+  binary.topic[k] = topic;
+  binary.ndcg[k] = (float) value[0];
+  binary.rbp[k] = (float) value[1];
+  binary.err[k] = (float) value[2];
+  binary.errBound[k] = (float) value[3];
+  binary.errTruncated[k] = (uint32_t) value[4];
+  binary.rows++;
+
+  if (binary.fill == BINARY_BLOCK)
+    binaryFlush ();
+}
+
+static void
+binaryClose (void)
+{
+  static char pad[8];
+  uint64_t offset;
+  uint32_t runs = binary.runs, depth = NDCG_DEPTH, zero = 0;
+  size_t bytes = 0;
+  int i;
+
+  binaryFlush ();
+  offset = 16 + (binary.flags & BINARY_ERR_BOUND ? 32 : 24)*binary.rows;
+
+  for (i = 0; i < binary.runs; i++)
+    {
+      binaryWrite (binary.runid[i], strlen (binary.runid[i]) + 1);
+      bytes += strlen (binary.runid[i]) + 1;
+    }
+  binaryWrite (pad, (8 - bytes%8)%8);
+
+  binaryWrite (&binary.rows, sizeof (binary.rows));
+  binaryWrite (&offset, sizeof (offset));
+  binaryWrite (&runs, sizeof (runs));
+  binaryWrite (&depth, sizeof (depth));
+  binaryWrite (&binary.flags, sizeof (binary.flags));
+  binaryWrite (&zero, sizeof (zero));
+  binaryWrite (BINARY_MAGIC, 8);
+
+  if (fclose (binary.fp) != 0)
+    error ("cannot write binary output \"%s\"\n", binaryName);
+
+  localFree (binary.run1);
+  localFree (binary.run2);
+  localFree (binary.topic);
+  localFree (binary.ndcg);
+  localFree (binary.rbp);
+  localFree (binary.err);
+  localFree (binary.errBound);
+  localFree (binary.errTruncated);
+  localFree (binary.runid);
+}
+
+/*
+  Sketches.  With --sketch-threshold, each run gets a MinHash sketch of
+  the top SKETCH_DEPTH documents for every topic, and a pair of runs is
+  only evaluated if the mean estimated Jaccard similarity of its common
+  topics reaches the threshold.  The number of skipped pairs goes to
+  stderr.
+*/
+
+/* SKETCH_DEPTH: Number of top-ranked documents in a topic's sketch. */
+#define SKETCH_DEPTH NDCG_DEPTH
+/* SKETCH_HASHES: Number of MinHash values in a topic's sketch. */
+#define SKETCH_HASHES 32
+
+static double sketchThreshold = -1.0;
+
+/* struct sketch:
+        MinHash sketch of one topic of one run.
+*/
+struct sketch {
+  int topic;
+  uint64_t min[SKETCH_HASHES];
+};
+
+/* hashString:
+        64-bit FNV-1a hash of a string.
+*/
+static uint64_t
+hashString (const char *s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (; *s; s++)
+    h = (h ^ (unsigned char) *s)*0x100000001b3ULL;
+
+  return h;
+}
+
+/* sketchRun:
+        Build sketches for every topic of a run sorted by topic; returns
+        the number of topics.
+*/
+static int
+sketchRun (struct result *r, int size, struct sketch **sketch)
+{
+  int i, k, n = 0, topic = 0;
+  struct sketch *s = (struct sketch *) 0;
+
+  for (; size > 0; r += i, size -= i)
+    {
+      i = nextTopicSize (r, size, &topic);
+      s = localRealloc (s, (n + 1)*sizeof (struct sketch));
+      s[n].topic = topic;
+      for (k = 0; k < SKETCH_HASHES; k++)
+        s[n].min[k] = UINT64_MAX;
+      for (k = 0; k < i; k++)
+        if (r[k].rank <= SKETCH_DEPTH)
+          {
+            uint64_t h = hashString (r[k].docno);
+            int m;
+
+            for (m = 0; m < SKETCH_HASHES; m++)
+              {
+                uint64_t state = h + m, x = splitmix64 (&state);
+
+                if (x < s[n].min[m])
+                  s[n].min[m] = x;
+              }
+          }
+      n++;
+    }
+
+  *sketch = s;
+  return n;
+}
+
+/* sketchSimilarity:
+        Mean estimated Jaccard similarity over the topics two runs share.
+*/
+static double
+sketchSimilarity (struct sketch *s1, int n1, struct sketch *s2, int n2)
+{
+  int i = 0, j = 0, k, common = 0;
+  double total = 0.0;
+
+  while (i < n1 && j < n2)
+    if (s1[i].topic < s2[j].topic)
+      i++;
+    else if (s1[i].topic > s2[j].topic)
+      j++;
+    else
+      {
+        int same = 0;
+
+        for (k = 0; k < SKETCH_HASHES; k++)
+          same += (s1[i].min[k] == s2[j].min[k]);
+        total += (double) same/SKETCH_HASHES;
+        common++;
+        i++;
+        j++;
+      }
+
+  return (common > 0 ? total/common : 0.0);
+}
+
+/* struct run:
+        A loaded run, sorted by topic and then docno.  rel holds the
+        relevance labels of its results under each qrels variant in turn.
+        hash and shared hold its topic hashes for memoization (see
+        memoRuns), or NULL.
+*/
+struct run {
+  char *runid;
+  struct result *r;
+  int size;
+  int *rel;
+  uint32_t binary;
+  struct sketch *sketch;
+  int sketches;
+  uint64_t *hash;
+  char *shared;
+  int topics;
+};
+
+/* pairTopic:
+        Cross label one topic of two runs, given in docno order, and copy
+        the results into rank order in s1 and s2.  Ranks run from 1 to the
+        topic size, thanks to forceTraditionalRanks and applyCutoff.
+*/
+static void
+pairTopic (
+  struct result *d1, int size1, struct result *d2, int size2,
+  struct result *s1, struct result *s2
+)
+{
+  int k;
+
+  for (k = 0; k < size1; k++)
+    d1[k].rankx = -1;
+  for (k = 0; k < size2; k++)
+    d2[k].rankx = -1;
+
+  crossLabelRuns (d1, size1, d2, size2);
+
+  for (k = 0; k < size1; k++)
+    s1[d1[k].rank - 1] = d1[k];
+  for (k = 0; k < size2; k++)
+    s2[d2[k].rank - 1] = d2[k];
+}
+
+/* pairLabel:
+        Apply one qrels variant's labels, given in docno order, to the
+        rank ordered copy made by pairTopic.
+*/
+static void
+pairLabel (struct result *d, int size, int *rel, struct result *s)
+{
+  int k;
+
+  for (k = 0; k < size; k++)
+    s[d[k].rank - 1].rel = rel[k];
+}
+
+/*
+  Parameter sweeps.  With --psi and/or --ndcg-depths, MED-RBP is computed
+  for every listed PSI and MED-nDCG for every listed depth in one pass
+  over each topic.  Since MED-RBP doesn't depend on the nDCG depth and
+  MED-nDCG doesn't depend on PSI, one column per value covers every
+  combination.  Per-position weights come from tables laid out with the
+  parameter as the inner dimension, so the accumulation loops over the
+  parameters vectorize.  MED-ERR depends on neither and isn't computed.
+*/
+
+static double *sweepPsi = (double *) 0;
+static int sweepPsis = 0;
+static int *sweepDepth = (int *) 0;
+static int sweepDepths = 0;
+
+/* sweepPower: sweepPower[d*sweepPsis + k] = pow(sweepPsi[k], d) */
+static double *sweepPower = (double *) 0;
+/* sweepNorm: sweepNorm[m] = ndcgNorm (sweepDepth[m]) */
+static double *sweepNorm = (double *) 0;
+
+/* ndcgDiscount: ndcgDiscount[rank] = 1.0/log2(rank + 1), once built */
+static double *ndcgDiscount = (double *) 0;
+
+static void
+ndcgDiscounts (void)
+{
+  int d;
+
+  if (ndcgDiscount)
+    return;
+
+  ndcgDiscount = localMalloc ((DEPTH + 1)*sizeof (double));
+  for (d = 1; d <= DEPTH; d++)
+    ndcgDiscount[d] = 1.0/log2 ((double) d + 1);
+}
+
+/* setSweep:
+        Parse a comma separated list of PSI values or nDCG depths.
+*/
+static void
+setSweep (char *list, int depths)
+{
+  char *item, *end;
+
+  for (item = strtok (list, ","); item; item = strtok (NULL, ","))
+    if (depths)
+      {
+        int depth = naturalNumber (item);
+
+        if (depth < 1 || depth > DEPTH)
+          error ("bad nDCG depth \"%s\"\n", item);
+        sweepDepth = localRealloc (sweepDepth, (sweepDepths + 1)*sizeof (int));
+        sweepDepth[sweepDepths++] = depth;
+      }
+    else
+      {
+        double psi = strtod (item, &end);
+
+        if (*end || end == item || !(psi > 0.0 && psi < 1.0))
+          error ("bad PSI value \"%s\"\n", item);
+        sweepPsi = localRealloc (sweepPsi, (sweepPsis + 1)*sizeof (double));
+        sweepPsi[sweepPsis++] = psi;
+      }
+}
+
+/* sweepTables:
+        Fill in defaults for an unlisted parameter and build the tables.
+*/
+static void
+sweepTables (void)
+{
+  int d, k;
+
+  if (sweepPsis == 0)
+    {
+      sweepPsi = localMalloc (sizeof (double));
+      sweepPsi[sweepPsis++] = PSI;
+    }
+  if (sweepDepths == 0)
+    {
+      sweepDepth = localMalloc (sizeof (int));
+      sweepDepth[sweepDepths++] = NDCG_DEPTH;
+    }
+
+  sweepPower = localMalloc ((RBP_DEPTH + 1)*sweepPsis*sizeof (double));
+  for (d = 0; d <= RBP_DEPTH; d++)
+    for (k = 0; k < sweepPsis; k++)
+      sweepPower[d*sweepPsis + k] = pow (sweepPsi[k], d);
+
+  ndcgDiscounts ();
+
+  sweepNorm = localMalloc (sweepDepths*sizeof (double));
+  for (k = 0; k < sweepDepths; k++)
+    sweepNorm[k] = ndcgNorm (sweepDepth[k]);
+}
+
+/* rbpSweepHalf:
+        rbpHalf for every PSI at once.
+*/
+static void
+rbpSweepHalf (
+  struct result *r, int size, int sizex, double *max, double *predetermined
+)
+{
+  int i, k, n = sweepPsis;
+
+  for (k = 0; k < n; k++)
+    max[k] = predetermined[k] = 0.0;
+
+  for (i = 0; i < size; i++)
+    {
+      double *w = sweepPower + (r[i].rank - 1)*n;
+
+      if (r[i].rel == -1)
+        {
+          if (
+            r[i].rankx == -1
+            || (r[i].rank < r[i].rankx && r[i].rankx >= sizex)
+          )
+            for (k = 0; k < n; k++)
+              max[k] += w[k];
+          else if (r[i].rank < r[i].rankx)
+            {
+              double *wx = sweepPower + (r[i].rankx - 1)*n;
+
+              for (k = 0; k < n; k++)
+                max[k] += (w[k] - wx[k]);
+            }
+        }
+      else if (r[i].rel > 0)
+        for (k = 0; k < n; k++)
+          predetermined[k] += w[k];
+    }
+
+  for (k = 0; k < n; k++)
+    max[k] += sweepPower[size*n + k]/(1 - sweepPsi[k]);
+}
+
+/* rbpSweep:
+        rbpMaximize for every PSI at once.
+*/
+static void
+rbpSweep (
+  struct result *r1, int size1, struct result *r2, int size2, double *med
+)
+{
+  int k, n = sweepPsis;
+  double *max1 = localMalloc (4*n*sizeof (double));
+  double *pre1 = max1 + n, *max2 = pre1 + n, *pre2 = max2 + n;
+
+  size1 = (size1 > RBP_DEPTH ? RBP_DEPTH : size1);
+  size2 = (size2 > RBP_DEPTH ? RBP_DEPTH : size2);
+  rbpSweepHalf (r1, size1, size2, max1, pre1);
+  rbpSweepHalf (r2, size2, size1, max2, pre2);
+
+  for (k = 0; k < n; k++)
+    {
+      double m1 = max1[k] + (pre1[k] - pre2[k]);
+      double m2 = max2[k] + (pre2[k] - pre1[k]);
+
+      med[k] = (1.0 - sweepPsi[k])*(m1 > m2 ? m1 : m2);
+    }
+
+  localFree (max1);
+}
+
+/* ndcgSweepHalf:
+        ndcgHalf for every depth at once.  A position only counts for the
+        depths that reach it, and whether its document is bound depends on
+        how much of the other list each depth keeps.
+*/
+static void
+ndcgSweepHalf (
+  struct result *r, int size, int sizex, double *max, double *predetermined
+)
+{
+  int i, m, n = sweepDepths;
+
+  for (m = 0; m < n; m++)
+    max[m] = predetermined[m] = 0.0;
+
+  for (i = 0; i < size; i++)
+    {
+      int rank = r[i].rank, rankx = r[i].rankx;
+      double discount = ndcgDiscount[rank];
+
+      if (r[i].rel == -1 && rankx == -1)
+        for (m = 0; m < n; m++)
+          max[m] += (rank <= sweepDepth[m] ? rp[G]*discount : 0.0);
+      else if (r[i].rel == -1 && rank < rankx)
+        {
+          double unbound = rp[G]*discount;
+          double bound = rp[G]*(discount - ndcgDiscount[rankx]);
+
+          for (m = 0; m < n; m++)
+            {
+              int sizem = (sizex < sweepDepth[m] ? sizex : sweepDepth[m]);
+
+              max[m] += (
+                rank > sweepDepth[m] ? 0.0 : (rankx < sizem ? bound : unbound)
+              );
+            }
+        }
+      else if (r[i].rel > 0)
+        for (m = 0; m < n; m++)
+          predetermined[m] += (
+            rank <= sweepDepth[m] ? rp[r[i].rel]*discount : 0.0
+          );
+    }
+}
+
+/* ndcgSweep:
+        ndcgMaximize for every depth at once.
+*/
+static void
+ndcgSweep (
+  struct result *r1, int size1, struct result *r2, int size2, double *med
+)
+{
+  int m, n = sweepDepths;
+  double *max1 = localMalloc (4*n*sizeof (double));
+  double *pre1 = max1 + n, *max2 = pre1 + n, *pre2 = max2 + n;
+
+  ndcgSweepHalf (r1, size1, size2, max1, pre1);
+  ndcgSweepHalf (r2, size2, size1, max2, pre2);
+
+  for (m = 0; m < n; m++)
+    {
+      double m1 = max1[m] + (pre1[m] - pre2[m]);
+      double m2 = max2[m] + (pre2[m] - pre1[m]);
+
+      med[m] = (m1 > m2 ? m1 : m2)/sweepNorm[m];
+    }
+
+  localFree (max1);
+}
+
+/*
+  Depth curves.  With --depth-curve K, MED-nDCG@k and MED-RBP truncated
+  at depth k are computed for every k from 1 to K.  As k grows, a
+  document starts to count at k = rank, and a bound document's credit
+  drops by the other list's weight at k = rankx + 1, once that list
+  reaches it.  Recording those changes in difference arrays gives the
+  whole curve from one pass over the topic and a prefix sum.
+*/
+
+static int curveDepth = 0;
+
+/* curvePower: curvePower[d] = pow(PSI, d) */
+static double *curvePower = (double *) 0;
+/* curveNorm: curveNorm[k] = ndcgNorm (k) */
+static double *curveNorm = (double *) 0;
+
+static void
+curveTables (void)
+{
+  int d;
+
+  ndcgDiscounts ();
+
+  curvePower = localMalloc ((DEPTH + 1)*sizeof (double));
+  for (d = 0; d <= DEPTH; d++)
+    curvePower[d] = pow (PSI, d);
+
+  curveNorm = localMalloc ((curveDepth + 1)*sizeof (double));
+  curveNorm[0] = 0.0;
+  for (d = 1; d <= curveDepth; d++)
+    curveNorm[d] = curveNorm[d - 1] + rp[G]/log2 (d + 1);
+}
+
+/* curveHalf:
+        ndcgHalf and rbpHalf (less the RBP tail) at every depth from 1 to
+        curveDepth.  The four arrays have curveDepth + 2 entries, and come
+        back holding the values for depth k at index k.  sizex is the full
+        size of the other list.
+*/
+static void
+curveHalf (
+  struct result *r, int size, int sizex,
+  double *ndcgMax, double *ndcgPre, double *rbpMax, double *rbpPre
+)
+{
+  int i, k, K = curveDepth;
+
+  for (k = 0; k <= K + 1; k++)
+    ndcgMax[k] = ndcgPre[k] = rbpMax[k] = rbpPre[k] = 0.0;
+
+  for (i = 0; i < size && r[i].rank <= K; i++)
+    {
+      int rank = r[i].rank, rankx = r[i].rankx;
+
+      if (r[i].rel == -1 && (rankx == -1 || rank < rankx))
+        {
+          ndcgMax[rank] += rp[G]*ndcgDiscount[rank];
+          rbpMax[rank] += curvePower[rank - 1];
+          /* bound once depth k > rankx, provided the other list has it */
+          if (rankx != -1 && rankx < sizex && rankx + 1 <= K)
+            {
+              ndcgMax[rankx + 1] -= rp[G]*ndcgDiscount[rankx];
+              rbpMax[rankx + 1] -= curvePower[rankx - 1];
+            }
+        }
+      else if (r[i].rel > 0)
+        {
+          ndcgPre[rank] += rp[r[i].rel]*ndcgDiscount[rank];
+          rbpPre[rank] += curvePower[rank - 1];
+        }
+    }
+
+  for (k = 1; k <= K; k++)
+    {
+      ndcgMax[k] += ndcgMax[k - 1];
+      ndcgPre[k] += ndcgPre[k - 1];
+      rbpMax[k] += rbpMax[k - 1];
+      rbpPre[k] += rbpPre[k - 1];
+    }
+}
+
+/* curveTopic:
+        MED-nDCG and MED-RBP at every depth from 1 to curveDepth for one
+        topic; ndcg[k - 1] and rbp[k - 1] are the values at depth k.
+*/
+static void
+curveTopic (
+  struct result *r1, int size1, struct result *r2, int size2,
+  double *ndcg, double *rbp
+)
+{
+  int k, K = curveDepth;
+  double *half = localMalloc (8*(K + 2)*sizeof (double));
+  double *ndcgMax1 = half, *ndcgPre1 = ndcgMax1 + K + 2;
+  double *rbpMax1 = ndcgPre1 + K + 2, *rbpPre1 = rbpMax1 + K + 2;
+  double *ndcgMax2 = rbpPre1 + K + 2, *ndcgPre2 = ndcgMax2 + K + 2;
+  double *rbpMax2 = ndcgPre2 + K + 2, *rbpPre2 = rbpMax2 + K + 2;
+
+  curveHalf (r1, size1, size2, ndcgMax1, ndcgPre1, rbpMax1, rbpPre1);
+  curveHalf (r2, size2, size1, ndcgMax2, ndcgPre2, rbpMax2, rbpPre2);
+
+  for (k = 1; k <= K; k++)
+    {
+      double m1 = ndcgMax1[k] + (ndcgPre1[k] - ndcgPre2[k]);
+      double m2 = ndcgMax2[k] + (ndcgPre2[k] - ndcgPre1[k]);
+
+      ndcg[k - 1] = (m1 > m2 ? m1 : m2)/curveNorm[k];
+
+      /* to infinity and beyond, from the end of each truncated list */
+      m1 = rbpMax1[k] + curvePower[k < size1 ? k : size1]/(1 - PSI);
+      m2 = rbpMax2[k] + curvePower[k < size2 ? k : size2]/(1 - PSI);
+      m1 += rbpPre1[k] - rbpPre2[k];
+      m2 += rbpPre2[k] - rbpPre1[k];
+      rbp[k - 1] = (1.0 - PSI)*(m1 > m2 ? m1 : m2);
+    }
+
+  localFree (half);
+}
+
+static void
+curvePrint (double *value, double scale)
+{
+  int k;
+
+  for (k = 0; k < curveDepth; k++)
+    printf ("%s%.5f", (k ? " " : ","), value[k]*scale);
+}
+
+/* medColumns:
+        Number of values computed for each topic in the current mode.  The
+        standard values are MED-nDCG, MED-RBP, MED-ERR, the bound on MED-ERR
+        and whether the MED-ERR search was truncated.
+*/
+static int
+medColumns (void)
+{
+  if (sweepPsi)
+    return sweepDepths + sweepPsis;
+  if (curveDepth > 0)
+    return 2*curveDepth;
+  return 5;
+}
+
+/* medTopic:
+        Compute the values for one topic of a pair of runs, in rank order
+        and cross labelled.
+*/
+static void
+medTopic (
+  struct result *s1, int size1, struct result *s2, int size2, double *value
+)
+{
+  int truncated;
+
+  if (sweepPsi)
+    {
+      ndcgSweep (s1, size1, s2, size2, value);
+      rbpSweep (s1, size1, s2, size2, value + sweepDepths);
+    }
+  else if (curveDepth > 0)
+    curveTopic (s1, size1, s2, size2, value, value + curveDepth);
+  else
+    {
+      value[0] = ndcgMaximize (s1, size1, s2, size2);
+      value[1] = rbpMaximize (s1, size1, s2, size2);
+      value[2] = errMaximize (s1, size1, s2, size2, value + 3, &truncated);
+      value[4] = truncated;
+    }
+}
+
+/* qrelsName: the qrels files, one per variant; a "qrels" column leads
+   each row when there is more than one */
+static char **qrelsName = (char **) 0;
+static int qrelsFiles = 0;
+
+static void
+printKey (int variant, struct run *run1, struct run *run2)
+{
+  if (qrelsFiles > 1)
+    printf ("%s,", qrelsName[variant]);
+  printf ("%s,%s", run1->runid, run2->runid);
+}
+
+/* printValues:
+        Print the value fields of a CSV row.  For an amean row, value holds
+        totals over n topics and bootstrap the per-topic values (if any).
+*/
+static void
+printValues (double *value, int n, struct medValues *bootstrapValues)
+{
+  int k, amean = (n >= 0);
+  double scale = (n > 0 ? 1.0/n : amean ? 0.0 : 1.0);
+
+  if (sweepPsi)
+    for (k = 0; k < sweepDepths + sweepPsis; k++)
+      printf (",%.5f", value[k]*scale);
+  else if (curveDepth > 0)
+    {
+      curvePrint (value, scale);
+      curvePrint (value + curveDepth, scale);
+    }
+  else
+    {
+      printf (
+        ",%.5f,%.5f,%.5f", value[0]*scale, value[1]*scale, value[2]*scale
+      );
+      /* on the amean row, ERR-truncated is the number of truncated topics */
+      if (errNodeLimit > 0 || errUsecLimit > 0)
+        printf (",%.5f,%d", value[3]*scale, (int) value[4]);
+      if (bootstrapSamples > 0 && amean && n > 0)
+        {
+          struct medValues lo, hi;
+
+          bootstrap (bootstrapValues, n, &lo, &hi);
+          printf (
+            ",%.5f,%.5f,%.5f,%.5f,%.5f,%.5f",
+            lo.ndcg, hi.ndcg, lo.rbp, hi.rbp, lo.err, hi.err
+          );
+        }
+      else if (bootstrapSamples > 0 && amean)
+        printf (",0.00000,0.00000,0.00000,0.00000,0.00000,0.00000");
+      else if (bootstrapSamples > 0)
+        printf (",,,,,,");
+    }
+  printf ("\n");
+}
+
+/*
+  Sharded, checkpointed jobs.  The work of a job is its (pair, topic)
+  items, with pairs numbered in the order they are compared.  With
+  --shard i/n a process takes the items that hash to i modulo n, and
+  with --checkpoint it appends the values of each item to a file
+  instead of printing them, as exact hex floats.  The file starts with
+  the job's arguments (less --shard and --checkpoint), lists the runids
+  and the pairs compared, and ends with "done" once the shard is
+  finished.  Restarting a shard on its checkpoint skips the items it
+  already holds.  "med merge" then reads the checkpoints of every shard
+  and prints the rows and amean rows the unsharded job would have.
+
+  Checkpoint format, one tab separated record per line:
+        CHECKPOINT_MAGIC shard shards arg...
+        run index runid
+        pair index run1 run2
+        value pair topic value...   (all variants, variant major)
+        done
+*/
+
+#define CHECKPOINT_MAGIC "medckpt1"
+#define CHECKPOINT_FLUSH_SECONDS 5
+
+static int shardIndex = 0, shardCount = 1;
+static char *checkpointName = (char *) 0;
+static FILE *checkpointFile = (FILE *) 0;
+static time_t checkpointFlushed;
+
+/* jobArgs: the arguments defining the job, recorded in the header */
+static char **jobArgs = (char **) 0;
+static int jobArgc = 0;
+
+/* checkpointDone: sorted keys of the items already in the checkpoint */
+static uint64_t *checkpointDone = (uint64_t *) 0;
+static int checkpointDones = 0;
+
+static uint64_t
+itemKey (int pair, int topic)
+{
+  return ((uint64_t) pair << 32) | (uint32_t) topic;
+}
+
+static int
+compareKey (const void *a, const void *b)
+{
+  uint64_t ak = *(uint64_t *) a, bk = *(uint64_t *) b;
+  return (ak > bk) - (ak < bk);
+}
+
+/* itemMine:
+        Is a (pair, topic) item this shard's, and still to be done?
+*/
+static int
+itemMine (int pair, int topic)
+{
+  uint64_t key = itemKey (pair, topic), state = key;
+
+  if (
+    shardCount > 1
+    && splitmix64 (&state) % shardCount != (uint64_t) shardIndex
+  )
+    return 0;
+  return checkpointDones == 0 || !bsearch (
+    &key, checkpointDone, checkpointDones, sizeof (uint64_t), compareKey
+  );
+}
+
+/* setShard:
+        Parse a --shard value of the form i/n.
+*/
+static void
+setShard (char *s)
+{
+  char *slash = strchr (s, '/');
+
+  if (slash)
+    {
+      *slash = '\0';
+      shardIndex = naturalNumber (s);
+      shardCount = naturalNumber (slash + 1);
+      *slash = '/';
+    }
+  if (!slash || shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount)
+    error ("bad --shard value \"%s\"\n", s);
+}
+
+/* jobArg:
+        Record an argument defining the job.  Options are recorded as
+        parsed, by long name, so the header doesn't depend on how they
+        were spelled; --shard and --checkpoint are left out.  Arguments
+        are copied, as option parsing may split some of them in place.
+*/
+static void
+jobArg (char *arg)
+{
+  if (strpbrk (arg, "\t\n"))
+    error ("can't checkpoint an argument with a tab or newline\n");
+  jobArgs = localRealloc (jobArgs, (jobArgc + 1)*sizeof (char *));
+  jobArgs[jobArgc++] = localStrdup (arg);
+}
+
+/* checkpointHeader:
+        Split a checkpoint header line in place into the shard, the number
+        of shards and the job arguments; returns the number of arguments,
+        or -1 if the line isn't a header.
+*/
+static int
+checkpointHeader (char *line, int *shard, int *shards, char ***args)
+{
+  char *s;
+  int n = 0;
+
+  if (strncmp (line, CHECKPOINT_MAGIC "\t", strlen (CHECKPOINT_MAGIC) + 1) != 0)
+    return -1;
+  *args = localMalloc ((strlen (line) + 1)*sizeof (char *));
+  for (s = strtok (line, "\t"); s; s = strtok ((char *) 0, "\t"))
+    (*args)[n++] = s;
+  if (n < 3)
+    return -1;
+  *shard = naturalNumber ((*args)[1]);
+  *shards = naturalNumber ((*args)[2]);
+  *args += 3;
+  return n - 3;
+}
+
+/* checkpointTrim:
+        Cut off a last line left partly written by an interrupted shard.
+*/
+static void
+checkpointTrim (void)
+{
+  FILE *fp = fopen (checkpointName, "r+");
+  long end, keep = 0, at = 0;
+  int c;
+
+  if (fp == NULL)
+    error ("cannot open checkpoint file \"%s\"\n", checkpointName);
+  if (fseek (fp, 0L, SEEK_END) != 0 || (end = ftell (fp)) < 0)
+    error ("cannot seek in checkpoint file \"%s\"\n", checkpointName);
+  if (end > 0)
+    {
+      fseek (fp, end - 1, SEEK_SET);
+      if (getc (fp) != '\n')
+        {
+          rewind (fp);
+          while ((c = getc (fp)) != EOF)
+            if (++at, c == '\n')
+              keep = at;
+          fflush (fp);
+          if (ftruncate (fileno (fp), (off_t) keep) != 0)
+            error ("cannot truncate checkpoint file \"%s\"\n", checkpointName);
+        }
+    }
+  fclose (fp);
+}
+
+/* checkpointOpen:
+        Open the checkpoint, resuming from it if it exists.  Returns 0 if
+        the shard was already finished.
+*/
+static int
+checkpointOpen (void)
+{
+  FILE *fp;
+  char *line, *f[3];
+  int i, maxDone = 0, finished = 0;
+
+  if (access (checkpointName, F_OK) == 0)
+    {
+      checkpointTrim ();
+      if ((fp = fopen (checkpointName, "r")) == NULL)
+        error ("cannot open checkpoint file \"%s\"\n", checkpointName);
+      if ((line = getLine (fp)) != NULL)
+        {
+          char **args;
+          int shard, shards, n;
+
+          n = checkpointHeader (line, &shard, &shards, &args);
+          if (n < 0)
+            error ("\"%s\" is not a checkpoint file\n", checkpointName);
+          if (shard != shardIndex || shards != shardCount || n != jobArgc)
+            error (
+              "checkpoint file \"%s\" belongs to a different shard or job\n",
+              checkpointName
+            );
+          for (i = 0; i < n; i++)
+            if (strcmp (args[i], jobArgs[i]) != 0)
+              error (
+                "checkpoint file \"%s\" belongs to a different job\n",
+                checkpointName
+              );
+          localFree (args - 3);
+        }
+      while ((line = getLine (fp)) != NULL)
+        if (strcmp (line, "done") == 0)
+          finished = 1;
+        else if (
+          strncmp (line, "value\t", 6) == 0 && trecSplit (line, f, 3) == 3
+        )
+          {
+            if (checkpointDones == maxDone)
+              {
+                maxDone = (maxDone ? 2*maxDone : 1024);
+                checkpointDone = localRealloc (
+                  checkpointDone, maxDone*sizeof (uint64_t)
+                );
+              }
+            checkpointDone[checkpointDones++] = itemKey (
+              naturalNumber (f[1]), naturalNumber (f[2])
+            );
+          }
+      fclose (fp);
+      if (finished)
+        return 0;
+      qsort (checkpointDone, checkpointDones, sizeof (uint64_t), compareKey);
+    }
+
+  if ((checkpointFile = fopen (checkpointName, "a")) == NULL)
+    error ("cannot open checkpoint file \"%s\"\n", checkpointName);
+  if (ftell (checkpointFile) == 0)
+    {
+      fprintf (
+        checkpointFile, CHECKPOINT_MAGIC "\t%d\t%d", shardIndex, shardCount
+      );
+      for (i = 0; i < jobArgc; i++)
+        fprintf (checkpointFile, "\t%s", jobArgs[i]);
+      fprintf (checkpointFile, "\n");
+    }
+  checkpointFlushed = time ((time_t *) 0);
+  return 1;
+}
+
+static void
+checkpointFlush (void)
+{
+  if (fflush (checkpointFile) != 0)
+    error ("cannot write checkpoint file \"%s\"\n", checkpointName);
+  checkpointFlushed = time ((time_t *) 0);
+}
+
+/* checkpointValues:
+        Save the values of a (pair, topic) item, flushing them to the file
+        every few seconds so an interrupted shard loses little work.
+*/
+static void
+checkpointValues (int pair, int topic, double *value, int n)
+{
+  int k;
+
+  fprintf (checkpointFile, "value\t%d\t%d", pair, topic);
+  for (k = 0; k < n; k++)
+    fprintf (checkpointFile, "\t%a", value[k]);
+  fprintf (checkpointFile, "\n");
+  if (time ((time_t *) 0) - checkpointFlushed >= CHECKPOINT_FLUSH_SECONDS)
+    checkpointFlush ();
+}
+
+static void
+checkpointClose (void)
+{
+  fprintf (checkpointFile, "done\n");
+  checkpointFlush ();
+  if (fclose (checkpointFile) != 0)
+    error ("cannot write checkpoint file \"%s\"\n", checkpointName);
+  checkpointFile = (FILE *) 0;
+}
+
+/*
+  Memoized topics.  Runs in a pool often return identical rankings for a
+  topic, and MED depends only on the two rankings and their labels.  Each
+  topic of each run is hashed, per qrels variant, over its docnos in rank
+  order and then their labels, and the values for a pair of rankings are
+  cached under the two hashes when either occurs more than once in the
+  pool: with B and C identical, (A, B) and (A, C) share a key even if A
+  is unique, while a pair of unique rankings can't come up again.
+  Identical rankings don't short-circuit to zero: MED-RBP still counts
+  the residual beyond the depth of the runs, and a truncated MED-ERR
+  search its bound, so they are cached like any other pair.
+*/
+
+#define MEMO_BYTES (256 << 20)
+
+/* struct memoEntry:
+        A cached pair of topic hashes; entry is the 1-based index of its
+        values in memoValue, or 0 if the slot is empty.
+*/
+struct memoEntry {
+  uint64_t hash1, hash2;
+  int entry;
+};
+
+static struct memoEntry *memo = (struct memoEntry *) 0;
+static int memoSize = 0, memoEntries = 0;
+static double *memoValue = (double *) 0;
+
+static struct memoEntry *
+memoSlot (uint64_t hash1, uint64_t hash2)
+{
+  uint64_t state = hash1 ^ (hash2*0x9e3779b97f4a7c15ULL);
+  int i = (int) (splitmix64 (&state) & (uint64_t) (memoSize - 1));
+
+  while (
+    memo[i].entry && (memo[i].hash1 != hash1 || memo[i].hash2 != hash2)
+  )
+    i = (i + 1) & (memoSize - 1);
+  return memo + i;
+}
+
+/* memoFind:
+        The cached values for a pair of topic hashes, or NULL.
+*/
+static double *
+memoFind (uint64_t hash1, uint64_t hash2, int columns)
+{
+  struct memoEntry *m;
+
+  if (memoEntries == 0)
+    return (double *) 0;
+  m = memoSlot (hash1, hash2);
+  return (
+    m->entry ? memoValue + (size_t) (m->entry - 1)*columns : (double *) 0
+  );
+}
+
+/* memoAdd:
+        Cache the values for a pair of topic hashes, while the cache is
+        within MEMO_BYTES.  The table is kept at most half full.
+*/
+static void
+memoAdd (uint64_t hash1, uint64_t hash2, double *value, int columns)
+{
+  struct memoEntry *m;
+  int i, k;
+
+  if ((size_t) (memoEntries + 1)*columns*sizeof (double) > MEMO_BYTES)
+    return;
+
+  if (2*(memoEntries + 1) > memoSize)
+    {
+      struct memoEntry *old = memo;
+      int oldSize = memoSize;
+
+      memoSize = (memoSize ? 2*memoSize : 1024);
+      memo = localMalloc (memoSize*sizeof (struct memoEntry));
+      for (i = 0; i < memoSize; i++)
+        memo[i].entry = 0;
+      for (i = 0; i < oldSize; i++)
+        if (old[i].entry)
+          *memoSlot (old[i].hash1, old[i].hash2) = old[i];
+      localFree (old);
+      memoValue = localRealloc (
+        memoValue, (size_t) memoSize/2*columns*sizeof (double)
+      );
+    }
+
+  m = memoSlot (hash1, hash2);
+  m->hash1 = hash1;
+  m->hash2 = hash2;
+  m->entry = ++memoEntries;
+  for (k = 0; k < columns; k++)
+    memoValue[(size_t) (memoEntries - 1)*columns + k] = value[k];
+}
+
+/* topicHash:
+        Hash one topic of a run, given in docno order, as ranked: its
+        docnos in rank order, then their labels if rel is given.  order is
+        scratch space of DEPTH ints.
+*/
+static uint64_t
+topicHash (struct result *d, int size, int *rel, int *order)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const char *s;
+  int k;
+
+  for (k = 0; k < size; k++)
+    order[d[k].rank - 1] = k;
+
+  for (k = 0; k < size; k++)
+    {
+      for (s = d[order[k]].docno; *s; s++)
+        h = (h ^ (unsigned char) *s)*0x100000001b3ULL;
+      h *= 0x100000001b3ULL;
+    }
+  if (rel)
+    for (k = 0; k < size; k++)
+      h = (h ^ (uint64_t) (rel[order[k]] + 1))*0x100000001b3ULL;
+
+  return h;
+}
+
+/* memoRuns:
+        Hash every topic of every run under each qrels variant, and flag
+        the hashes that occur more than once.  A run's hashes are laid out
+        variant major: hash[v*topics + t].
+*/
+static void
+memoRuns (struct run *run, int runs, int variants)
+{
+  int *order = localMalloc (DEPTH*sizeof (int));
+  uint64_t *all, *found;
+  int i, k, n, size, topic, total = 0;
+  struct result *r;
+
+  for (i = 0; i < runs; i++)
+    {
+      run[i].topics = 0;
+      r = run[i].r;
+      n = run[i].size;
+      while (n > 0)
+        {
+          size = nextTopicSize (r, n, &topic);
+          run[i].topics++;
+          r += size;
+          n -= size;
+        }
+      run[i].hash = localMalloc (variants*run[i].topics*sizeof (uint64_t));
+      run[i].shared = localMalloc (variants*run[i].topics);
+
+      k = 0;
+      r = run[i].r;
+      n = run[i].size;
+      while (n > 0)
+        {
+          int v, *rel = (int *) 0;
+
+          if (qrelsFiles > 0)
+            rel = run[i].rel + (r - run[i].r);
+          size = nextTopicSize (r, n, &topic);
+          for (v = 0; v < variants; v++)
+            run[i].hash[v*run[i].topics + k] = topicHash (
+              r, size, rel ? rel + v*run[i].size : (int *) 0, order
+            );
+          k++;
+          r += size;
+          n -= size;
+        }
+      total += variants*run[i].topics;
+    }
+
+  all = localMalloc ((total + 1)*sizeof (uint64_t));
+  for (i = 0, n = 0; i < runs; i++)
+    for (k = 0; k < variants*run[i].topics; k++)
+      all[n++] = run[i].hash[k];
+  qsort (all, total, sizeof (uint64_t), compareKey);
+
+  for (i = 0; i < runs; i++)
+    for (k = 0; k < variants*run[i].topics; k++)
+      {
+        found = bsearch (
+          run[i].hash + k, all, total, sizeof (uint64_t), compareKey
+        );
+        run[i].shared[k] = (
+          (found > all && found[-1] == *found)
+          || (found < all + total - 1 && found[1] == *found)
+        );
+      }
+
+  localFree (all);
+  localFree (order);
+}
+
+/* struct pair:
+        Accumulated state while a pair of runs is evaluated topic by topic.
+        index numbers the pair within the job.  s1 and s2 are scratch space
+        of DEPTH results each.
+*/
+struct pair {
+  struct run *run1, *run2;
+  struct result *s1, *s2;
+  int index, variants, columns, n, maxValues;
+  double *value, *total;
+  struct medValues **values;
+};
+
+static void
+pairStart (
+  struct pair *p, int index, struct run *run1, struct run *run2,
+  struct result *s1, struct result *s2
+)
+{
+  int k, v;
+
+  p->run1 = run1;
+  p->run2 = run2;
+  p->s1 = s1;
+  p->s2 = s2;
+  p->index = index;
+  p->variants = (qrelsFiles > 1 ? qrelsFiles : 1);
+  p->columns = medColumns ();
+  p->n = p->maxValues = 0;
+  p->value = localMalloc (2*p->variants*p->columns*sizeof (double));
+  p->total = p->value + p->variants*p->columns;
+  p->values = localMalloc (p->variants*sizeof (struct medValues *));
+
+  for (k = 0; k < p->variants*p->columns; k++)
+    p->total[k] = 0.0;
+  for (v = 0; v < p->variants; v++)
+    p->values[v] = (struct medValues *) 0;
+}
+
+/* pairRecord:
+        Accumulate and print the values of one topic, given for each qrels
+        variant in turn.  A checkpointed shard saves them instead.
+*/
+static void
+pairRecord (struct pair *p, int topic, double *value)
+{
+  int k, v;
+
+  if (checkpointFile)
+    {
+      checkpointValues (p->index, topic, value, p->variants*p->columns);
+      return;
+    }
+
+  if (bootstrapSamples > 0 && p->n == p->maxValues)
+    {
+      p->maxValues = (p->maxValues ? 2*p->maxValues : 1024);
+      for (v = 0; v < p->variants; v++)
+        p->values[v] = localRealloc (
+          p->values[v], p->maxValues*sizeof (struct medValues)
+        );
+    }
+
+  for (v = 0; v < p->variants; v++, value += p->columns)
+    {
+      for (k = 0; k < p->columns; k++)
+        p->total[v*p->columns + k] += value[k];
+      if (bootstrapSamples > 0)
+        {
+          p->values[v][p->n].ndcg = value[0];
+          p->values[v][p->n].rbp = value[1];
+          p->values[v][p->n].err = value[2];
+        }
+      if (binaryName)
+        binaryRow (p->run1->binary, p->run2->binary, topic, value);
+      else
+        {
+          printKey (v, p->run1, p->run2);
+          printf (",%d", topic);
+          printValues (value, -1, (struct medValues *) 0);
+        }
+    }
+
+  p->n++;
+}
+
+/* pairAdd:
+        Compute MED for one topic common to both runs, under each qrels
+        variant, if the topic is this shard's to do.  r1 and r2 point to
+        the topic within the runs, and t1 and t2 number it among their
+        topics.  Cross labelling is shared by the variants; only the
+        relevance labels change between them.  Pairs of rankings seen
+        before take their cached values, skipping cross labelling
+        altogether when every variant can.
+*/
+static void
+pairAdd (
+  struct pair *p, int topic,
+  struct result *r1, int i, int t1, struct result *r2, int j, int t2
+)
+{
+  struct run *run1 = p->run1, *run2 = p->run2;
+  struct result *s1 = p->s1, *s2 = p->s2;
+  int k, v, crossed = 0;
+
+  if (checkpointFile && !itemMine (p->index, topic))
+    return;
+
+  for (v = 0; v < p->variants; v++)
+    {
+      double *value = p->value + v*p->columns, *cached = (double *) 0;
+      uint64_t hash1 = 0, hash2 = 0;
+      int shared = 0;
+
+      if (run1->hash && run2->hash)
+        {
+          hash1 = run1->hash[v*run1->topics + t1];
+          hash2 = run2->hash[v*run2->topics + t2];
+          shared = (
+            run1->shared[v*run1->topics + t1]
+            || run2->shared[v*run2->topics + t2]
+          );
+          if (shared && (cached = memoFind (hash1, hash2, p->columns)))
+            {
+              for (k = 0; k < p->columns; k++)
+                value[k] = cached[k];
+              continue;
+            }
+        }
+
+      if (!crossed)
+        {
+          pairTopic (r1, i, r2, j, s1, s2);
+          crossed = 1;
+        }
+      if (qrelsFiles > 0)
+        {
+          pairLabel (r1, i, run1->rel + v*run1->size + (r1 - run1->r), s1);
+          pairLabel (r2, j, run2->rel + v*run2->size + (r2 - run2->r), s2);
+        }
+      medTopic (s1, i, s2, j, value);
+      if (shared)
+        memoAdd (hash1, hash2, value, p->columns);
+    }
+
+  pairRecord (p, topic, p->value);
+}
+
+/* pairFinish:
+        Print the amean rows for a pair of runs, unless they're left for
+        "med merge".
+*/
+static void
+pairFinish (struct pair *p)
+{
+  int v;
+
+  for (v = 0; v < p->variants; v++)
+    {
+      if (!checkpointFile)
+        {
+          printKey (v, p->run1, p->run2);
+          printf (",amean");
+          printValues (p->total + v*p->columns, p->n, p->values[v]);
+        }
+      localFree (p->values[v]);
+    }
+
+  localFree (p->value);
+  localFree (p->values);
+}
+
+/* medPair:
+        Compute and print MED for every topic of a pair of loaded runs.
+*/
+static void
+medPair (
+  int index, struct run *run1, struct run *run2,
+  struct result *s1, struct result *s2
+)
+{
+  int i, j, topic1 = 0, topic2 = 0, size1 = run1->size, size2 = run2->size;
+  int t1 = 0, t2 = 0;
+  struct result *r1 = run1->r, *r2 = run2->r;
+  struct pair p;
+
+  pairStart (&p, index, run1, run2, s1, s2);
+
+  while (size1 > 0 && size2 > 0)
+    {
+      i = nextTopicSize (r1, size1, &topic1);
+      j = nextTopicSize (r2, size2, &topic2);
+      if (topic1 < topic2)
+        {
+          r1 += i;
+          size1 -= i;
+          t1++;
+        }
+      else if (topic1 > topic2)
+        {
+          r2 += j;
+          size2 -= j;
+          t2++;
+        }
+      else
+        {
+          pairAdd (&p, topic1, r1, i, t1++, r2, j, t2++);
+          r1 += i;
+          size1 -= i;
+          r2 += j;
+          size2 -= j;
+        }
+    }
+
+  pairFinish (&p);
+}
+
+/*
+  External memory runs.  With --memory, each run is parsed in chunks that
+  fit in half the budget, less the stdio buffers of the chunk files.
+  Every chunk is sorted into traditional TREC order and, unless it's the
+  last, spilled to a temporary file.  To bound the number of open files,
+  every CHUNK_FANIN spilled chunks of one level are merged into a single
+  chunk of the next level, and the rest are merged down to fewer than
+  CHUNK_FANIN at the end.  The chunks are then merged back a topic at a
+  time, applying ranks, the depth cutoff and the duplicate docno check
+  per topic as loadRun does for a whole run, and each topic common to
+  the two runs is labelled and evaluated before the next is read.
+*/
+
+#define CHUNK_FANIN 16
+
+static size_t memoryBudget = 0;
+
+/* struct chunk:
+        One sorted chunk of a run, either spilled to fp or held in r, with
+        the next result to merge in head.  level counts the merges that
+        made a spilled chunk.
+*/
+struct chunk {
+  FILE *fp;
+  struct result *r;
+  int size, next, level;
+  struct result head;
+};
+
+/* struct runStream:
+        A run being merged back from its chunks.  heap orders the chunks
+        that still have results by their heads.
+*/
+struct runStream {
+  char *name, *runid;
+  struct chunk *chunk;
+  int chunks;
+  int *heap, heapSize;
+};
+
+static void
+chunkWrite (struct runStream *rs, FILE *fp, struct result *r)
+{
+  int length = strlen (r->docno);
+
+  if (
+    fwrite (&(r->topic), sizeof (int), 1, fp) != 1
+    || fwrite (&(r->score), sizeof (double), 1, fp) != 1
+    || fwrite (&length, sizeof (int), 1, fp) != 1
+    || fwrite (r->docno, length, 1, fp) != 1
+  )
+    error ("cannot write temporary file for run file \"%s\"\n", rs->name);
+}
+
+/* chunkCreate:
+        Add a spilled chunk of size results to a run, returning its
+        temporary file.
+*/
+static FILE *
+chunkCreate (struct runStream *rs, int size, int level)
+{
+  struct chunk *c;
+
+  rs->chunk = localRealloc (rs->chunk, (rs->chunks + 1)*sizeof (struct chunk));
+  c = rs->chunk + rs->chunks++;
+  c->r = (struct result *) 0;
+  c->size = size;
+  c->next = 0;
+  c->level = level;
+
+  if ((c->fp = tmpfile ()) == NULL)
+    error ("cannot create temporary file for run file \"%s\"\n", rs->name);
+  return c->fp;
+}
+
+static void
+chunkRewind (struct runStream *rs, FILE *fp)
+{
+  if (fflush (fp) != 0 || fseek (fp, 0, SEEK_SET) != 0)
+    error ("cannot write temporary file for run file \"%s\"\n", rs->name);
+}
+
+static void
+chunkSpill (struct runStream *rs, struct result *r, int size)
+{
+  FILE *fp = chunkCreate (rs, size, 0);
+  int i;
+
+  for (i = 0; i < size; i++)
+    {
+      chunkWrite (rs, fp, r + i);
+      localFree (r[i].docno);
+    }
+  chunkRewind (rs, fp);
+}
+
+/* chunkNext:
+        Advance a chunk to its next result; returns 0 when it has none.
+*/
+static int
+chunkNext (struct runStream *rs, struct chunk *c)
+{
+  int length;
+
+  if (c->next == c->size)
+    {
+      if (c->fp)
+        fclose (c->fp);
+      c->r = localFree (c->r);
+      return 0;
+    }
+
+  if (c->fp == NULL)
+    {
+      c->head = c->r[c->next++];
+      return 1;
+    }
+
+  if (
+    fread (&(c->head.topic), sizeof (int), 1, c->fp) != 1
+    || fread (&(c->head.score), sizeof (double), 1, c->fp) != 1
+    || fread (&length, sizeof (int), 1, c->fp) != 1
+  )
+    error ("cannot read temporary file for run file \"%s\"\n", rs->name);
+  c->head.docno = localMalloc (length + 1);
+  if (length > 0 && fread (c->head.docno, length, 1, c->fp) != 1)
+    error ("cannot read temporary file for run file \"%s\"\n", rs->name);
+  c->head.docno[length] = '\0';
+  c->head.runid = rs->runid;
+  c->head.rank = c->head.rankx = c->head.rel = -1;
+  c->next++;
+  return 1;
+}
+
+static int
+chunkBefore (struct runStream *rs, int a, int b)
+{
+  return resultCompareByScore (&(rs->chunk[a].head), &(rs->chunk[b].head)) < 0;
+}
+
+static void
+heapDown (struct runStream *rs, int i)
+{
+  for (;;)
+    {
+      int least = i, left = 2*i + 1, right = 2*i + 2, swap;
+
+      if (
+        left < rs->heapSize
+        && chunkBefore (rs, rs->heap[left], rs->heap[least])
+      )
+        least = left;
+      if (
+        right < rs->heapSize
+        && chunkBefore (rs, rs->heap[right], rs->heap[least])
+      )
+        least = right;
+      if (least == i)
+        return;
+      swap = rs->heap[i];
+      rs->heap[i] = rs->heap[least];
+      rs->heap[least] = swap;
+      i = least;
+    }
+}
+
+/* chunkMerge:
+        Merge the last n spilled chunks of a run into one.
+*/
+static void
+chunkMerge (struct runStream *rs, int n)
+{
+  int i, first = rs->chunks - n, size = 0, level = 0;
+  FILE *fp;
+
+  rs->heap = localMalloc (n*sizeof (int));
+  rs->heapSize = 0;
+  for (i = first; i < rs->chunks; i++)
+    {
+      size += rs->chunk[i].size;
+      if (rs->chunk[i].level > level)
+        level = rs->chunk[i].level;
+      if (chunkNext (rs, rs->chunk + i))
+        rs->heap[rs->heapSize++] = i;
+    }
+  for (i = rs->heapSize/2 - 1; i >= 0; i--)
+    heapDown (rs, i);
+
+  fp = chunkCreate (rs, size, level + 1);
+  while (rs->heapSize > 0)
+    {
+      struct chunk *c = rs->chunk + rs->heap[0];
+
+      chunkWrite (rs, fp, &(c->head));
+      localFree (c->head.docno);
+      if (!chunkNext (rs, c))
+        rs->heap[0] = rs->heap[--rs->heapSize];
+      heapDown (rs, 0);
+    }
+  chunkRewind (rs, fp);
+
+  /* chunkNext has closed the merged chunks */
+  rs->chunk[first] = rs->chunk[rs->chunks - 1];
+  rs->chunks = first + 1;
+  rs->heap = localFree (rs->heap);
+}
+
+/* chunkCascade:
+        After a spill, merge every CHUNK_FANIN chunks of the same level at
+        the end of the run; levels never increase along the chunks.
+*/
+static void
+chunkCascade (struct runStream *rs)
+{
+  for (;;)
+    {
+      int i, level = rs->chunk[rs->chunks - 1].level;
+
+      if (rs->chunks < CHUNK_FANIN)
+        return;
+      for (i = rs->chunks - CHUNK_FANIN; i < rs->chunks; i++)
+        if (rs->chunk[i].level != level)
+          return;
+      chunkMerge (rs, CHUNK_FANIN);
+    }
+}
+
+/* streamOpen:
+        Read a run into sorted chunks, spilling all but the last, and get
+        ready to merge them.
+*/
+static void
+streamOpen (char *name, struct runStream *rs)
+{
+  struct input *in;
+  struct result *r = (struct result *) 0;
+  size_t bytes = 0, buffers = (CHUNK_FANIN + 1)*(size_t) BUFSIZ;
+  size_t budget = memoryBudget/2;
+  int i, n = 0, max = 0, results = 0;
+
+  /* leave room for the stdio buffers of the chunks being merged */
+  budget = (budget > 2*buffers ? budget - buffers : budget/2);
+
+  rs->name = name;
+  rs->runid = (char *) 0;
+  rs->chunk = (struct chunk *) 0;
+  rs->chunks = 0;
+
+  if ((in = inputOpen (name)) == NULL)
+    error ("cannot open run file \"%s\"\n", name);
+
+  /* r is reused by every chunk; a chunk is full when r and its docnos
+     reach the budget, and r only grows to what the budget can hold at
+     the mean docno length so far */
+  for (;;)
+    {
+      if (n == max)
+        {
+          size_t fit = budget/(sizeof (struct result) + (n ? bytes/n : 0));
+          int grow = (max ? 2*max : 1024);
+
+          if (n > 0 && (size_t) max >= fit)
+            {
+              resultSortByScore (r, n);
+              chunkSpill (rs, r, n);
+              chunkCascade (rs);
+              n = 0;
+              bytes = 0;
+            }
+          else
+            {
+              max = (
+                (size_t) grow > fit && fit > (size_t) max ? (int) fit : grow
+              );
+              r = localRealloc (r, max*sizeof (struct result));
+            }
+        }
+      if (!readResult (in, &(rs->runid), r + n))
+        break;
+      bytes += strlen (r[n].docno) + 1;
+      n++;
+      results++;
+      if (max*sizeof (struct result) + bytes > budget)
+        {
+          resultSortByScore (r, n);
+          chunkSpill (rs, r, n);
+          chunkCascade (rs);
+          n = 0;
+          bytes = 0;
+        }
+    }
+
+  inputClose (in);
+
+  if (results == 0 && topicFilterSize > 0)
+    error ("no selected topics in run file \"%s\"\n", name);
+  if (results == 0)
+    error ("run file \"%s\" is empty\n", name);
+
+  /* merge down to fewer than CHUNK_FANIN spilled chunks, smallest first */
+  while (rs->chunks >= CHUNK_FANIN)
+    chunkMerge (
+      rs, (rs->chunks - CHUNK_FANIN + 2 < CHUNK_FANIN
+           ? rs->chunks - CHUNK_FANIN + 2 : CHUNK_FANIN)
+    );
+
+  /* the last chunk stays in memory */
+  resultSortByScore (r, n);
+  rs->chunk = localRealloc (rs->chunk, (rs->chunks + 1)*sizeof (struct chunk));
+  rs->chunk[rs->chunks].fp = (FILE *) 0;
+  rs->chunk[rs->chunks].r = r;
+  rs->chunk[rs->chunks].size = n;
+  rs->chunk[rs->chunks].next = 0;
+  rs->chunk[rs->chunks].level = 0;
+  rs->chunks++;
+
+  rs->heap = localMalloc (rs->chunks*sizeof (int));
+  rs->heapSize = 0;
+  for (i = 0; i < rs->chunks; i++)
+    if (chunkNext (rs, rs->chunk + i))
+      rs->heap[rs->heapSize++] = i;
+  for (i = rs->heapSize/2 - 1; i >= 0; i--)
+    heapDown (rs, i);
+}
+
+/* streamTopic:
+        Merge the next topic of a run into r (room for DEPTH results) in
+        docno order, with ranks assigned and the depth cutoff applied.
+        Returns the number of results, or 0 at the end of the run.
+*/
+static int
+streamTopic (struct runStream *rs, struct result *r, int *topic)
+{
+  int i, n = 0;
+
+  if (rs->heapSize == 0)
+    return 0;
+
+  *topic = rs->chunk[rs->heap[0]].head.topic;
+  while (rs->heapSize > 0 && rs->chunk[rs->heap[0]].head.topic == *topic)
+    {
+      struct chunk *c = rs->chunk + rs->heap[0];
+
+      if (n < DEPTH)
+        {
+          r[n] = c->head;
+          r[n].rank = n + 1;
+          r[n].rankx = r[n].rel = -1;
+          n++;
+        }
+      else
+        localFree (c->head.docno);
+
+      if (!chunkNext (rs, c))
+        rs->heap[0] = rs->heap[--rs->heapSize];
+      heapDown (rs, 0);
+    }
+
+  resultSortByDocno (r, n);
+  for (i = 1; i < n; i++)
+    if (strcmp (r[i].docno, r[i-1].docno) == 0)
+      error (
+        "duplicate docno (%s) for topic %d in run file \"%s\"\n",
+        r[i].docno, r[i].topic, rs->name
+      );
+
+  return n;
+}
+
+static void
+streamTopicFree (struct result *r, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    localFree (r[i].docno);
+}
+
+/* qrelsTopic:
+        Find the qrels for a topic in qrels sorted by topic; returns their
+        number and sets *start to the first.
+*/
+static int
+qrelsTopic (struct qrel *q, int size, int topic, struct qrel **start)
+{
+  int low = 0, high = size, end;
+
+  while (low < high)
+    {
+      int middle = low + (high - low)/2;
+
+      if (q[middle].topic < topic)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+
+  for (end = low; end < size && q[end].topic == topic; end++)
+    ;
+
+  *start = q + low;
+  return end - low;
+}
+
+/* labelTopic:
+        Fill in the labels of a run holding a single topic under every
+        qrels variant.
+*/
+static void
+labelTopic (struct run *run, int topic, struct qrel **q, int *sizeQ)
+{
+  int k, v;
+
+  for (v = 0; v < qrelsFiles; v++)
+    {
+      struct qrel *start;
+      int n = qrelsTopic (q[v], sizeQ[v], topic, &start);
+
+      labelQ (run->r, run->size, start, n);
+      for (k = 0; k < run->size; k++)
+        {
+          run->rel[v*run->size + k] = run->r[k].rel;
+          run->r[k].rel = -1;
+        }
+    }
+}
+
+/* printHeader:
+        Print the CSV header for the current mode.
+*/
+static void
+printHeader (void)
+{
+  int i;
+
+  if (qrelsFiles > 1)
+    printf ("qrels,");
+  if (sweepPsi || sweepDepth)
+    {
+      printf ("run1,run2,topic");
+      for (i = 0; i < sweepDepths; i++)
+        printf (",MED-nDCG@%d", sweepDepth[i]);
+      for (i = 0; i < sweepPsis; i++)
+        printf (",MED-RBP@%g", sweepPsi[i]);
+    }
+  else if (curveDepth > 0)
+    printf (
+      "run1,run2,topic,MED-nDCG@1..%d,MED-RBP@1..%d", curveDepth, curveDepth
+    );
+  else
+    {
+      printf ("run1,run2,topic,MED-nDCG@%d,MED-RBP,MED-ERR", NDCG_DEPTH);
+      if (errNodeLimit > 0 || errUsecLimit > 0)
+        printf (",MED-ERR-bound,ERR-truncated");
+      if (bootstrapSamples > 0)
+        printf (
+          ",MED-nDCG@%d-lo,MED-nDCG@%d-hi,MED-RBP-lo,MED-RBP-hi"
+          ",MED-ERR-lo,MED-ERR-hi",
+          NDCG_DEPTH, NDCG_DEPTH
+        );
+    }
+  printf ("\n");
+}
+
+/* medStream:
+        Compute and print MED for two runs, reading them a topic at a time
+        through the external memory path.
+*/
+static void
+medStream (char **runName, struct result *s1, struct result *s2)
+{
+  struct runStream rs1, rs2;
+  struct run run1, run2;
+  struct qrel **q = localMalloc ((qrelsFiles + 1)*sizeof (struct qrel *));
+  int *sizeQ = localMalloc ((qrelsFiles + 1)*sizeof (int));
+  struct result *t1 = localMalloc (DEPTH*sizeof (struct result));
+  struct result *t2 = localMalloc (DEPTH*sizeof (struct result));
+  int v, n1, n2, topic1, topic2;
+  struct pair p;
+
+  streamOpen (runName[0], &rs1);
+  streamOpen (runName[1], &rs2);
+  for (v = 0; v < qrelsFiles; v++)
+    q[v] = loadQ (qrelsName[v], sizeQ + v);
+
+  run1.runid = rs1.runid;
+  run2.runid = rs2.runid;
+  run1.r = t1;
+  run2.r = t2;
+  run1.rel = localMalloc ((qrelsFiles + 1)*DEPTH*sizeof (int));
+  run2.rel = localMalloc ((qrelsFiles + 1)*DEPTH*sizeof (int));
+  run1.hash = run2.hash = (uint64_t *) 0;
+  if (binaryName)
+    {
+      run1.binary = binaryRun (run1.runid);
+      run2.binary = binaryRun (run2.runid);
+    }
+  if (checkpointFile)
+    fprintf (
+      checkpointFile, "run\t0\t%s\nrun\t1\t%s\npair\t0\t0\t1\n",
+      run1.runid, run2.runid
+    );
+
+  pairStart (&p, 0, &run1, &run2, s1, s2);
+
+  n1 = streamTopic (&rs1, t1, &topic1);
+  n2 = streamTopic (&rs2, t2, &topic2);
+  while (n1 > 0 && n2 > 0)
+    if (topic1 < topic2)
+      {
+        streamTopicFree (t1, n1);
+        n1 = streamTopic (&rs1, t1, &topic1);
+      }
+    else if (topic1 > topic2)
+      {
+        streamTopicFree (t2, n2);
+        n2 = streamTopic (&rs2, t2, &topic2);
+      }
+    else
+      {
+        run1.size = n1;
+        run2.size = n2;
+        labelTopic (&run1, topic1, q, sizeQ);
+        labelTopic (&run2, topic2, q, sizeQ);
+        pairAdd (&p, topic1, t1, n1, 0, t2, n2, 0);
+        streamTopicFree (t1, n1);
+        streamTopicFree (t2, n2);
+        n1 = streamTopic (&rs1, t1, &topic1);
+        n2 = streamTopic (&rs2, t2, &topic2);
+      }
+
+  /* drain the rest, so every topic still gets its duplicate check */
+  for (; n1 > 0; n1 = streamTopic (&rs1, t1, &topic1))
+    streamTopicFree (t1, n1);
+  for (; n2 > 0; n2 = streamTopic (&rs2, t2, &topic2))
+    streamTopicFree (t2, n2);
+
+  pairFinish (&p);
+
+  localFree (t1);
+  localFree (t2);
+  localFree (run1.rel);
+  localFree (run2.rel);
+}
+
+/* med:
+        Compute MED between every pair of the named runs, in argument order,
+        under each of the qrels files (if any).
+*/
+static void
+med (char **runName, int runs)
+{
+  int i, j, v, pair = 0, skipped = 0;
+  struct run *run = localMalloc (runs*sizeof (struct run));
+  struct result *s1 = localMalloc (DEPTH*sizeof (struct result));
+  struct result *s2 = localMalloc (DEPTH*sizeof (struct result));
+
+  if (sweepPsi || sweepDepth)
+    sweepTables ();
+  else if (curveDepth > 0)
+    curveTables ();
+  if (!checkpointFile)
+    printHeader ();
+
+  if (memoryBudget > 0)
+    {
+      medStream (runName, s1, s2);
+      localFree (s1);
+      localFree (s2);
+      return;
+    }
+
+  for (i = 0; i < runs; i++)
+    {
+      run[i].r = loadRun (runName[i], &(run[i].size));
+      run[i].runid = run[i].r[0].runid;
+      run[i].rel = (
+        qrelsFiles > 0
+        ? localMalloc (qrelsFiles*run[i].size*sizeof (int)) : (int *) 0
+      );
+    }
+
+  /* label every run under each qrels variant in turn */
+  for (v = 0; v < qrelsFiles; v++)
+    {
+      struct qrel *q;
+      int sizeQ;
+
+      q = loadQ (qrelsName[v], &sizeQ);
+      for (i = 0; i < runs; i++)
+        {
+          int *rel = run[i].rel + v*run[i].size;
+
+          labelQ (run[i].r, run[i].size, q, sizeQ);
+          for (j = 0; j < run[i].size; j++)
+            {
+              rel[j] = run[i].r[j].rel;
+              run[i].r[j].rel = -1;
+            }
+        }
+      for (j = 0; j < sizeQ; j++)
+        localFree (q[j].docno);
+      localFree (q);
+    }
+
+  memoRuns (run, runs, qrelsFiles > 1 ? qrelsFiles : 1);
+  for (i = 0; i < runs; i++)
+    {
+      if (checkpointFile)
+        fprintf (checkpointFile, "run\t%d\t%s\n", i, run[i].runid);
+      if (binaryName)
+        run[i].binary = binaryRun (run[i].runid);
+      if (sketchThreshold >= 0.0)
+        run[i].sketches = sketchRun (run[i].r, run[i].size, &(run[i].sketch));
+    }
+
+  for (i = 0; i < runs; i++)
+    for (j = i + 1; j < runs; j++, pair++)
+      if (
+        sketchThreshold >= 0.0
+        && sketchSimilarity (
+             run[i].sketch, run[i].sketches, run[j].sketch, run[j].sketches
+           ) < sketchThreshold
+      )
+        skipped++;
+      else
+        {
+          if (checkpointFile)
+            fprintf (checkpointFile, "pair\t%d\t%d\t%d\n", pair, i, j);
+          medPair (pair, run + i, run + j, s1, s2);
+        }
+
+  if (sketchThreshold >= 0.0)
+    fprintf (
+      stderr, "%s: skipped %d of %d pairs with sketch similarity below %g\n",
+      getProgramName (), skipped, runs*(runs - 1)/2, sketchThreshold
+    );
+
+  localFree (s1);
+  localFree (s2);
 }
 
 static void
@@ -945,28 +3888,460 @@ computeRelevanceProbabilities ()
 static void
 usage ()
 {
-  error ("Usage: %s run1 run2 [qrels]\n", getProgramName());
+  error (
+    "Usage: %s [options] run1 run2 [qrels...]\n"
+    "       %s [options] --all-pairs run1 run2 run3...\n"
+    "       %s index file...\n"
+    "       %s merge checkpoint...\n"
+    "  --all-pairs    compare every pair of the runs given\n"
+    "  --qrels file   qrels file (the only way to give one with --all-pairs);\n"
+    "                 repeat for several variants, evaluated in one pass\n"
+    "  --sketch-threshold s\n"
+    "                 skip pairs whose mean MinHash similarity of the top\n"
+    "                 documents is below s; the count goes to stderr\n"
+    "  --topics list  evaluate only these topics, e.g. \"301,305,310-350\";\n"
+    "                 \"@file\" reads the list from a file\n"
+    "  --err-nodes n  stop the MED-ERR search for a topic after n nodes\n"
+    "  --err-usec t   stop the MED-ERR search for a topic after t\n"
+    "                 microseconds\n"
+    "                 (either adds an upper bound and a truncation flag)\n"
+    "  --bootstrap B  add 95%% bootstrap intervals from B resamples to amean\n"
+    "  --seed s       seed for the bootstrap resampling (default 1)\n"
+    "  --binary file  write per-topic values to a binary columnar file;\n"
+    "                 the CSV then has only the amean rows\n"
+    "  --psi list     sweep: MED-RBP for each PSI in a comma separated list\n"
+    "  --ndcg-depths list\n"
+    "                 sweep: MED-nDCG at each listed depth\n"
+    "  --depth-curve K\n"
+    "                 MED-nDCG and MED-RBP at every depth from 1 to K\n"
+    "  --memory MB    bound memory for loading the two runs, spilling sorted\n"
+    "                 chunks to temporary files and merging them by topic\n"
+    "  --shard i/n    do only shard i (from 0) of n of the (pair, topic)\n"
+    "                 items\n"
+    "  --checkpoint file\n"
+    "                 save values to file instead of printing them, resuming\n"
+    "                 from it if it exists; \"merge\" prints the job's output\n"
+    "                 from the checkpoints of all its shards\n",
+    getProgramName(), getProgramName(), getProgramName(), getProgramName()
+  );
+}
+
+/* parseArgs:
+        Parse the options of a job, leaving *argc and *argv with the runs.
+*/
+static void
+parseArgs (int *argc, char ***argv)
+{
+  static struct option options[] = {
+    { "all-pairs", no_argument, 0, 'A' },
+    { "qrels", required_argument, 0, 'q' },
+    { "sketch-threshold", required_argument, 0, 'S' },
+    { "topics", required_argument, 0, 't' },
+    { "err-nodes", required_argument, 0, 'n' },
+    { "err-usec", required_argument, 0, 'u' },
+    { "bootstrap", required_argument, 0, 'b' },
+    { "seed", required_argument, 0, 's' },
+    { "binary", required_argument, 0, 'B' },
+    { "psi", required_argument, 0, 'p' },
+    { "ndcg-depths", required_argument, 0, 'd' },
+    { "depth-curve", required_argument, 0, 'k' },
+    { "memory", required_argument, 0, 'm' },
+    { "shard", required_argument, 0, 'x' },
+    { "checkpoint", required_argument, 0, 'c' },
+    { 0, 0, 0, 0 }
+  };
+  char *end;
+  int c, megabytes, allPairs = 0;
+
+  while (
+    (c = getopt_long (
+       *argc, *argv, "Aq:S:t:n:u:b:s:B:p:d:k:m:x:c:", options, (int *) 0
+     )) != -1
+  )
+    {
+      struct option *o;
+
+      for (o = options; o->name && o->val != c; o++)
+        ;
+      if (o->name && c != 'x' && c != 'c')
+        {
+          char *name = localMalloc (strlen (o->name) + 3);
+
+          sprintf (name, "--%s", o->name);
+          jobArg (name);
+          localFree (name);
+          if (o->has_arg)
+            jobArg (optarg);
+        }
+
+      switch (c)
+        {
+        case 'A':
+          allPairs = 1;
+          break;
+        case 'q':
+          qrelsName = localRealloc (
+            qrelsName, (qrelsFiles + 1)*sizeof (char *)
+          );
+          qrelsName[qrelsFiles++] = optarg;
+          break;
+        case 'S':
+          sketchThreshold = strtod (optarg, &end);
+          if (
+            *end || end == optarg
+            || sketchThreshold < 0.0 || sketchThreshold > 1.0
+          )
+            error ("bad --sketch-threshold value \"%s\"\n", optarg);
+          break;
+        case 't':
+          setTopics (optarg);
+          break;
+        case 'n':
+          if ((errNodeLimit = naturalNumber (optarg)) <= 0)
+            error ("bad --err-nodes value \"%s\"\n", optarg);
+          break;
+        case 'u':
+          if ((errUsecLimit = naturalNumber (optarg)) <= 0)
+            error ("bad --err-usec value \"%s\"\n", optarg);
+          break;
+        case 'b':
+          if ((bootstrapSamples = naturalNumber (optarg)) <= 0)
+            error ("bad --bootstrap value \"%s\"\n", optarg);
+          break;
+        case 's':
+          if (naturalNumber (optarg) < 0)
+            error ("bad --seed value \"%s\"\n", optarg);
+          bootstrapSeed = naturalNumber (optarg);
+          break;
+        case 'B':
+          binaryName = optarg;
+          break;
+        case 'p':
+          setSweep (optarg, 0);
+          break;
+        case 'd':
+          setSweep (optarg, 1);
+          break;
+        case 'm':
+          if ((megabytes = naturalNumber (optarg)) <= 0)
+            error ("bad --memory value \"%s\"\n", optarg);
+          memoryBudget = (size_t) megabytes << 20;
+          break;
+        case 'x':
+          setShard (optarg);
+          break;
+        case 'c':
+          checkpointName = optarg;
+          break;
+        case 'k':
+          if ((curveDepth = naturalNumber (optarg)) < 1 || curveDepth > DEPTH)
+            error ("bad --depth-curve value \"%s\"\n", optarg);
+          break;
+        default:
+          usage ();
+        }
+    }
+  *argc -= optind;
+  *argv += optind;
+  for (c = 0; c < *argc; c++)
+    jobArg ((*argv)[c]);
+
+  if (*argc < 2 || (!allPairs && *argc > 2 && qrelsFiles > 0))
+    usage ();
+  if (!allPairs && *argc > 2)
+    {
+      qrelsName = *argv + 2;
+      qrelsFiles = *argc - 2;
+      *argc = 2;
+    }
+
+  /* sweeps and curves have their own columns and don't compute MED-ERR */
+  if (
+    (sweepPsi || sweepDepth || curveDepth > 0)
+    && (
+      binaryName || bootstrapSamples > 0
+      || errNodeLimit > 0 || errUsecLimit > 0
+    )
+  )
+    error (
+      "--psi, --ndcg-depths and --depth-curve can't be combined with\n"
+      "--binary, --bootstrap, --err-nodes or --err-usec\n"
+    );
+  if ((sweepPsi || sweepDepth) && curveDepth > 0)
+    error ("--depth-curve can't be combined with --psi or --ndcg-depths\n");
+  if (memoryBudget > 0 && (*argc != 2 || sketchThreshold >= 0.0))
+    error (
+      "--memory works on a single pair of runs, without --sketch-threshold\n"
+    );
+  if (binaryName && qrelsFiles > 1)
+    error ("--binary can't be combined with several qrels files\n");
+  if (shardCount > 1 && !checkpointName)
+    error ("--shard needs --checkpoint\n");
+}
+
+/* struct mergeItem:
+        The values of one (pair, topic) item read from a checkpoint.
+*/
+struct mergeItem {
+  uint64_t key;
+  double *value;
+};
+
+static int
+compareItem (const void *a, const void *b)
+{
+  return compareKey (
+    &((struct mergeItem *) a)->key, &((struct mergeItem *) b)->key
+  );
+}
+
+/* mergeCheckpoints:
+        "med merge": combine the checkpoints of every shard of a job and
+        print what the job would have printed unsharded.  The options are
+        those recorded in the checkpoints, and the rows come out in the
+        order of the unsharded job, so the amean rows sum and resample
+        the same values in the same order.
+*/
+static void
+mergeCheckpoints (int files, char **name)
+{
+  struct mergeItem *item = (struct mergeItem *) 0;
+  struct run *run = (struct run *) 0;
+  int *pairRun = (int *) 0;
+  char *shardSeen = (char *) 0, **args = (char **) 0, *header = (char *) 0;
+  int argc = 0, shards = 0, runs = 0, pairs = 0, items = 0, maxItems = 0;
+  int columns = 0, f, i, k;
+
+  for (f = 0; f < files; f++)
+    {
+      FILE *fp = fopen (name[f], "r");
+      char *line, **a, **fileArgs;
+      int shard, fileShards, n, finished = 0;
+
+      if (fp == NULL)
+        error ("cannot open checkpoint file \"%s\"\n", name[f]);
+      if (
+        (line = getLine (fp)) == NULL
+        || (n = checkpointHeader (
+              line = localStrdup (line), &shard, &fileShards, &fileArgs
+            )) < 0
+      )
+        error ("\"%s\" is not a checkpoint file\n", name[f]);
+
+      if (f == 0)
+        {
+          char **argv = localMalloc ((n + 2)*sizeof (char *));
+
+          header = line;
+          args = fileArgs;
+          argc = n;
+          shards = fileShards;
+          shardSeen = localMalloc (shards);
+          memset (shardSeen, 0, shards);
+
+          /* set up the job from its recorded options */
+          argv[0] = getProgramName ();
+          for (i = 0; i < n; i++)
+            argv[i + 1] = localStrdup (args[i]);
+          argv[n + 1] = (char *) 0;
+          n++;
+          optind = 0;
+          parseArgs (&n, &argv);
+          checkpointName = (char *) 0;
+          if (sweepPsi || sweepDepth)
+            sweepTables ();
+          else if (curveDepth > 0)
+            curveTables ();
+          columns = (qrelsFiles > 1 ? qrelsFiles : 1)*medColumns ();
+        }
+      else
+        {
+          if (fileShards != shards || n != argc)
+            error (
+              "checkpoint files \"%s\" and \"%s\" belong to different jobs\n",
+              name[0], name[f]
+            );
+          for (i = 0; i < n; i++)
+            if (strcmp (fileArgs[i], args[i]) != 0)
+              error (
+                "checkpoint files \"%s\" and \"%s\" belong to different jobs\n",
+                name[0], name[f]
+              );
+          localFree (fileArgs - 3);
+          localFree (line);
+        }
+      if (shard < 0 || shard >= shards || shardSeen[shard])
+        error ("checkpoint file \"%s\" repeats or has a bad shard\n", name[f]);
+      shardSeen[shard] = 1;
+
+      a = localMalloc ((columns + 4)*sizeof (char *));
+      while ((line = getLine (fp)) != NULL)
+        if (strcmp (line, "done") == 0)
+          finished = 1;
+        else if (strncmp (line, "run\t", 4) == 0)
+          {
+            if (trecSplit (line, a, 3) != 3 || (i = naturalNumber (a[1])) < 0)
+              error ("bad run line in checkpoint file \"%s\"\n", name[f]);
+            if (i >= runs)
+              {
+                run = localRealloc (run, (i + 1)*sizeof (struct run));
+                for (; runs <= i; runs++)
+                  run[runs].runid = (char *) 0;
+              }
+            if (run[i].runid == (char *) 0)
+              run[i].runid = localStrdup (a[2]);
+            else if (strcmp (run[i].runid, a[2]) != 0)
+              error (
+                "checkpoint file \"%s\" disagrees on the runid of run %d\n",
+                name[f], i
+              );
+          }
+        else if (strncmp (line, "pair\t", 5) == 0)
+          {
+            if (trecSplit (line, a, 4) != 4 || (i = naturalNumber (a[1])) < 0)
+              error ("bad pair line in checkpoint file \"%s\"\n", name[f]);
+            if (i >= pairs)
+              {
+                pairRun = localRealloc (pairRun, 2*(i + 1)*sizeof (int));
+                for (; pairs <= i; pairs++)
+                  pairRun[2*pairs] = -1;
+              }
+            pairRun[2*i] = naturalNumber (a[2]);
+            pairRun[2*i + 1] = naturalNumber (a[3]);
+          }
+        else if (strncmp (line, "value\t", 6) == 0)
+          {
+            int pair, topic;
+
+            if (
+              trecSplit (line, a, columns + 4) != columns + 3
+              || (pair = naturalNumber (a[1])) < 0
+              || (topic = naturalNumber (a[2])) < 0
+            )
+              error ("bad value line in checkpoint file \"%s\"\n", name[f]);
+            if (items == maxItems)
+              {
+                maxItems = (maxItems ? 2*maxItems : 1024);
+                item = localRealloc (item, maxItems*sizeof (struct mergeItem));
+              }
+            item[items].key = itemKey (pair, topic);
+            item[items].value = localMalloc (columns*sizeof (double));
+            for (k = 0; k < columns; k++)
+              item[items].value[k] = strtod (a[k + 3], (char **) 0);
+            items++;
+          }
+        else
+          error ("bad line in checkpoint file \"%s\"\n", name[f]);
+
+      if (!finished)
+        error (
+          "shard %d in checkpoint file \"%s\" isn't finished\n",
+          shard, name[f]
+        );
+      localFree (a);
+      fclose (fp);
+    }
+
+  for (i = 0; i < shards; i++)
+    if (!shardSeen[i])
+      error ("shard %d of %d is missing\n", i, shards);
+
+  qsort (item, items, sizeof (struct mergeItem), compareItem);
+  for (k = 1; k < items; k++)
+    if (item[k].key == item[k - 1].key)
+      error ("topic %d of pair %d is in more than one checkpoint\n",
+             (int) (uint32_t) item[k].key, (int) (item[k].key >> 32));
+  for (i = 0; i < pairs; i++)
+    if (
+      pairRun[2*i] >= 0
+      && (pairRun[2*i] >= runs
+          || pairRun[2*i + 1] < 0 || pairRun[2*i + 1] >= runs
+          || !run[pairRun[2*i]].runid || !run[pairRun[2*i + 1]].runid)
+    )
+      error ("pair %d names an unknown run\n", i);
+
+  if (binaryName)
+    binaryOpen ();
+  printHeader ();
+  for (i = 0; i < runs; i++)
+    if (binaryName && run[i].runid)
+      run[i].binary = binaryRun (run[i].runid);
+
+  for (i = 0, k = 0; i < pairs; i++)
+    if (pairRun[2*i] >= 0)
+      {
+        struct pair p;
+
+        pairStart (
+          &p, i, run + pairRun[2*i], run + pairRun[2*i + 1],
+          (struct result *) 0, (struct result *) 0
+        );
+        for (; k < items && (int) (item[k].key >> 32) == i; k++)
+          pairRecord (&p, (int) (uint32_t) item[k].key, item[k].value);
+        pairFinish (&p);
+      }
+  if (k < items)
+    error ("topic %d of pair %d belongs to no pair compared\n",
+           (int) (uint32_t) item[k].key, (int) (item[k].key >> 32));
+
+  if (binaryName)
+    binaryClose ();
+
+  for (k = 0; k < items; k++)
+    localFree (item[k].value);
+  for (i = 0; i < runs; i++)
+    localFree (run[i].runid);
+  localFree (item);
+  localFree (run);
+  localFree (pairRun);
+  localFree (shardSeen);
+  localFree (args - 3);
+  localFree (header);
 }
 
 int
 main (int argc, char **argv)
 {
-  char *run1, *run2, *qrels = (char *) 0;
-
   setProgramName (argv[0]);
 
-  if (argc == 3 || argc == 4)
+  if (argc >= 2 && strcmp (argv[1], "index") == 0)
     {
-      run1 = argv[1];
-      run2 = argv[2];
-      if (argc == 4)
-        qrels= argv[3];
+      if (argc == 2)
+        usage ();
+      indexFiles (argc - 2, argv + 2);
+      return 0;
+    }
+  if (argc >= 2 && strcmp (argv[1], "merge") == 0)
+    {
+      if (argc == 2)
+        usage ();
+      mergeCheckpoints (argc - 2, argv + 2);
+      return 0;
     }
-  else
-    usage ();
+
+  parseArgs (&argc, &argv);
 
   computeRelevanceProbabilities ();
-  med (run1, run2, qrels);
+  if (checkpointName)
+    {
+      /* the binary file is written by "med merge" */
+      binaryName = (char *) 0;
+      if (!checkpointOpen ())
+        {
+          fprintf (
+            stderr, "%s: shard %d of %d in \"%s\" is already done\n",
+            getProgramName (), shardIndex, shardCount, checkpointName
+          );
+          return 0;
+        }
+    }
+  if (binaryName)
+    binaryOpen ();
+  med (argv, argc);
+  if (checkpointFile)
+    checkpointClose ();
+  if (binaryName)
+    binaryClose ();
 
   return 0;
 }